@@ -0,0 +1,443 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_lpm.c
+ *
+ * Description:
+ *
+ * Route lookup microbenchmark, built and run by "make bench-lpm".  Loads a
+ * routing table in the sr_load_rt format (-f) or generates a synthetic one
+ * whose prefix lengths follow roughly the shape of a public BGP table,
+ * then measures every lookup engine on the same destinations:
+ *
+ *   list         - the original sr_longest_prefix_match linked list walk,
+ *                  including its per-lookup malloc'd copy of the route
+ *   linear       - sr_fib linear engine
+ *   trie, dir24  - sr_fib compiled engines, one sr_fib_lookup_flow per
+ *                  address
+ *   trie-burst,
+ *   dir24-burst  - the same engines through sr_fib_lookup_burst
+ *
+ * For each it reports lookups per second, p50/p99 latency and the memory
+ * taken by the table.  Lookups are timed in batches of BENCH_BATCH, so the
+ * latencies are per lookup averaged over one batch; clock reads would
+ * otherwise cost more than a DIR-24-8 lookup.  Slow engines stop after
+ * -t seconds.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_router.h"
+
+#define BENCH_BATCH        32
+#define DEFAULT_ROUTES     500000
+#define DEFAULT_LOOKUPS    4000000
+#define DEFAULT_SECONDS    5
+#define BENCH_NEXTHOPS     16
+#define BENCH_ENGINES      "list,linear,trie,dir24,trie-burst,dir24-burst"
+
+/* share of each prefix length in a synthetic table, per 100000 routes;
+ * about 60% /24s, most of the rest /16-/23, a thin tail either side */
+static const int bench_len_weight[33] =
+{
+    /*  0 */ 0,     0,     0,     0,     0,     0,     0,     0,
+    /*  8 */ 2,     2,     4,     10,    30,    60,    100,   170,
+    /* 16 */ 1400,  800,   1350,  2600,  4300,  4900,  10300, 9400,
+    /* 24 */ 64000, 60,    60,    60,    60,    60,    60,    60,
+    /* 32 */ 130
+};
+
+struct bench_result
+{
+    const char* name;
+    double lookups_per_sec;
+    double p50_ns;
+    double p99_ns;
+    size_t memory;
+    double build_ms;
+    long   lookups;
+};
+
+static uint32_t bench_rng_state = 1;
+
+/*---------------------------------------------------------------------
+ * Method: bench_rand
+ * Scope:  Local
+ *
+ * xorshift32, much faster than rand() and covers all 32 bits.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t bench_rand(void)
+{
+    uint32_t x = bench_rng_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return bench_rng_state = x;
+} /* -- bench_rand -- */
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+} /* -- bench_now -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_synthetic_table
+ * Scope:  Local
+ *
+ * Build a list of nroutes random unicast prefixes with lengths drawn from
+ * bench_len_weight, spread over BENCH_NEXTHOPS next hops on four
+ * interfaces.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_rt* bench_synthetic_table(int nroutes)
+{
+    struct sr_rt* list = 0;
+    struct sr_rt** tail = &list;
+    int total = 0;
+    int i, len;
+
+    for(len = 0; len <= 32; len++)
+    { total += bench_len_weight[len]; }
+
+    for(i = 0; i < nroutes; i++)
+    {
+        struct sr_rt* rt;
+        uint32_t addr, mask, first;
+        int nh, pick = bench_rand() % total;
+
+        for(len = 0; pick >= bench_len_weight[len]; len++)
+        { pick -= bench_len_weight[len]; }
+
+        /* -- skip 0/8, 127/8 and class D/E -- */
+        do
+        {
+            addr = bench_rand();
+            first = addr >> 24;
+        } while(first == 0 || first == 127 || first >= 224);
+
+        mask = len ? 0xffffffffU << (32 - len) : 0;
+        nh = bench_rand() % BENCH_NEXTHOPS;
+
+        rt = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+        assert(rt);
+        rt->dest.s_addr = htonl(addr & mask);
+        rt->mask.s_addr = htonl(mask);
+        rt->gw.s_addr   = htonl(0x0a000001U + (nh << 8));
+        snprintf(rt->interface, sr_IFACE_NAMELEN, "eth%d", nh % 4 + 1);
+
+        *tail = rt;
+        tail = &(rt->next);
+    }
+
+    return list;
+} /* -- bench_synthetic_table -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_destinations
+ * Scope:  Local
+ *
+ * Fill ips with n destinations: 90% inside a random route of the table,
+ * the rest uniformly random, so both hits and misses are exercised.
+ *
+ *---------------------------------------------------------------------*/
+
+static void bench_destinations(struct sr_rt* list, uint32_t* ips, long n)
+{
+    struct sr_rt** routes;
+    struct sr_rt* rt;
+    long nroutes = 0;
+    long i;
+
+    for(rt = list; rt; rt = rt->next)
+    { nroutes++; }
+    routes = (struct sr_rt**)malloc(nroutes * sizeof(struct sr_rt*));
+    assert(routes);
+    nroutes = 0;
+    for(rt = list; rt; rt = rt->next)
+    { routes[nroutes++] = rt; }
+
+    for(i = 0; i < n; i++)
+    {
+        if(bench_rand() % 10 == 0)
+        {
+            ips[i] = bench_rand();
+            continue;
+        }
+        rt = routes[bench_rand() % nroutes];
+        ips[i] = (rt->dest.s_addr & rt->mask.s_addr) |
+                 (bench_rand() & ~rt->mask.s_addr);
+    }
+
+    free(routes);
+} /* -- bench_destinations -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_list_lookup
+ * Scope:  Local
+ *
+ * The routing lookup as it was before the FIB: walk the whole list and
+ * return a malloc'd copy of the best match, which the caller frees.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_rt* bench_list_lookup(struct sr_rt* list, uint32_t ip)
+{
+    struct sr_rt* best = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    struct sr_rt* rt;
+
+    best->gw.s_addr = 0;
+    best->mask.s_addr = 0;
+
+    for(rt = list; rt != NULL; rt = rt->next)
+    {
+        if(((ip & rt->mask.s_addr) == rt->dest.s_addr) &&
+           (rt->mask.s_addr >= best->mask.s_addr))
+        { memcpy(best, rt, sizeof(struct sr_rt)); }
+    }
+
+    return best;
+} /* -- bench_list_lookup -- */
+
+static int bench_cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+} /* -- bench_cmp_double -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_run
+ * Scope:  Local
+ *
+ * Look up ips[0..n) batch by batch with one engine (fib, or the list if
+ * fib is 0), stopping early after max_seconds.  Fills in the throughput
+ * and latency fields of res.
+ *
+ *---------------------------------------------------------------------*/
+
+static void bench_run(struct sr_rt* list, const struct sr_fib* fib, int burst,
+                      const uint32_t* ips, long n, double max_seconds,
+                      struct bench_result* res)
+{
+    const struct sr_nexthop* nhs[BENCH_BATCH];
+    double* samples;
+    double start, elapsed = 0;
+    volatile uint32_t sink = 0;
+    long nbatches = n / BENCH_BATCH;
+    long b;
+    int i;
+
+    samples = (double*)malloc((nbatches ? nbatches : 1) * sizeof(double));
+    assert(samples);
+
+    start = bench_now();
+    for(b = 0; b < nbatches; b++)
+    {
+        const uint32_t* batch = ips + b * BENCH_BATCH;
+        double t0 = bench_now();
+
+        if(fib == 0)
+        {
+            for(i = 0; i < BENCH_BATCH; i++)
+            {
+                struct sr_rt* rt = bench_list_lookup(list, batch[i]);
+                sink += rt->gw.s_addr;
+                free(rt);
+            }
+        }
+        else if(burst)
+        {
+            sr_fib_lookup_burst(fib, batch, batch, BENCH_BATCH, nhs);
+            for(i = 0; i < BENCH_BATCH; i++)
+            { sink += nhs[i] ? nhs[i]->gw.s_addr : 0; }
+        }
+        else
+        {
+            for(i = 0; i < BENCH_BATCH; i++)
+            {
+                const struct sr_nexthop* nh =
+                    sr_fib_lookup_flow(fib, batch[i], batch[i]);
+                sink += nh ? nh->gw.s_addr : 0;
+            }
+        }
+
+        samples[b] = (bench_now() - t0) * 1e9 / BENCH_BATCH;
+        elapsed = bench_now() - start;
+        if(elapsed > max_seconds)
+        {
+            b++;
+            break;
+        }
+    }
+
+    qsort(samples, b, sizeof(double), bench_cmp_double);
+    res->lookups = b * BENCH_BATCH;
+    res->lookups_per_sec = elapsed > 0 ? res->lookups / elapsed : 0;
+    res->p50_ns = b ? samples[b / 2] : 0;
+    res->p99_ns = b ? samples[(b * 99) / 100] : 0;
+
+    free(samples);
+} /* -- bench_run -- */
+
+static void usage(char* argv0)
+{
+    printf("Format: %s [-f rtable] [-n routes] [-l lookups] [-s seed]\n"
+           "           [-t seconds] [-e engines]\n", argv0);
+    printf("  -f  benchmark this routing table (sr_load_rt format) instead of\n"
+           "      a synthetic one\n");
+    printf("  -n  synthetic table size (default %d)\n", DEFAULT_ROUTES);
+    printf("  -l  lookups per engine (default %d)\n", DEFAULT_LOOKUPS);
+    printf("  -t  stop an engine after this many seconds (default %d)\n",
+           DEFAULT_SECONDS);
+    printf("  -e  comma separated engines (default %s)\n", BENCH_ENGINES);
+} /* -- usage -- */
+
+int main(int argc, char** argv)
+{
+    static struct sr_instance sr;
+    struct sr_rt* list;
+    struct bench_result res;
+    const char* rtable = 0;
+    char engines[256];
+    char* name;
+    uint32_t* ips;
+    long nroutes = DEFAULT_ROUTES;
+    long nlookups = DEFAULT_LOOKUPS;
+    double max_seconds = DEFAULT_SECONDS;
+    struct sr_rt* rt;
+    int c;
+
+    strncpy(engines, BENCH_ENGINES, sizeof(engines));
+
+    while((c = getopt(argc, argv, "hf:n:l:s:t:e:")) != EOF)
+    {
+        switch(c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'f':
+                rtable = optarg;
+                break;
+            case 'n':
+                nroutes = atol(optarg);
+                break;
+            case 'l':
+                nlookups = atol(optarg);
+                break;
+            case 's':
+                bench_rng_state = (uint32_t)atol(optarg) | 1;
+                break;
+            case 't':
+                max_seconds = atof(optarg);
+                break;
+            case 'e':
+                strncpy(engines, optarg, sizeof(engines));
+                engines[sizeof(engines) - 1] = 0;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if(rtable)
+    {
+        sr_epoch_init(&(sr.fib_epoch));
+        sr.fib_engine = sr_fib_linear;
+        if(sr_load_rt(&sr, rtable) != 0 || sr.routing_table == 0)
+        {
+            fprintf(stderr, "Cannot load a text routing table from %s\n",
+                    rtable);
+            exit(1);
+        }
+        list = sr.routing_table;
+    }
+    else
+    {
+        if(nroutes <= 0)
+        {
+            usage(argv[0]);
+            exit(1);
+        }
+        list = bench_synthetic_table(nroutes);
+    }
+
+    nroutes = 0;
+    for(rt = list; rt; rt = rt->next)
+    { nroutes++; }
+    nlookups -= nlookups % BENCH_BATCH;
+    if(nlookups <= 0)
+    { nlookups = BENCH_BATCH; }
+
+    ips = (uint32_t*)malloc(nlookups * sizeof(uint32_t));
+    assert(ips);
+    bench_destinations(list, ips, nlookups);
+
+    printf("%ld routes (%s), %ld lookups per engine\n\n", nroutes,
+           rtable ? rtable : "synthetic", nlookups);
+    printf("%-12s %10s %12s %10s %10s %10s %10s\n", "engine", "build ms",
+           "Mlookups/s", "p50 ns", "p99 ns", "memory MB", "lookups");
+
+    for(name = strtok(engines, ","); name; name = strtok(0, ","))
+    {
+        struct sr_fib* fib = 0;
+        char base[32];
+        int burst = 0;
+        int engine;
+        double t0;
+
+        memset(&res, 0, sizeof(res));
+        res.name = name;
+
+        strncpy(base, name, sizeof(base));
+        base[sizeof(base) - 1] = 0;
+        if(strlen(base) > 6 && strcmp(base + strlen(base) - 6, "-burst") == 0)
+        {
+            base[strlen(base) - 6] = 0;
+            burst = 1;
+        }
+
+        if(strcmp(base, "list") == 0 && !burst)
+        {
+            res.memory = nroutes * sizeof(struct sr_rt);
+            bench_run(list, 0, 0, ips, nlookups, max_seconds, &res);
+        }
+        else if((engine = sr_fib_engine_from_name(base)) >= 0)
+        {
+            t0 = bench_now();
+            fib = sr_fib_build(list, (enum sr_fib_engine)engine);
+            res.build_ms = (bench_now() - t0) * 1e3;
+            res.memory = sr_fib_memory(fib);
+            bench_run(list, fib, burst, ips, nlookups, max_seconds, &res);
+            sr_fib_destroy(fib);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown engine %s\n", name);
+            continue;
+        }
+
+        printf("%-12s %10.1f %12.3f %10.1f %10.1f %10.1f %10ld\n", res.name,
+               res.build_ms, res.lookups_per_sec / 1e6, res.p50_ns,
+               res.p99_ns, res.memory / (1024.0 * 1024.0), res.lookups);
+    }
+
+    free(ips);
+    return 0;
+} /* -- main -- */
@@ -11,6 +11,7 @@
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include <string.h>
 
 #include "sr_utils.h"
@@ -25,9 +26,11 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
     struct sr_arpreq * temp ;
     struct sr_arpcache* cache;
     cache = & (sr->cache);
+    int epoch_slot = sr_epoch_enter(&(sr->fib_epoch));
     for ( temp=cache->requests; temp != NULL; temp=temp->next) {
          handle_arpreq(sr, temp);
     }
+    sr_epoch_exit(&(sr->fib_epoch), epoch_slot);
 }
 
 /* 
@@ -46,22 +49,33 @@ void handle_arpreq(struct sr_instance* sr,  struct sr_arpreq* request) {
         if(request->times_sent >= 5){
             /*send icmp host unreachable to source addr of all pkts waiting */
             struct sr_packet* wait_packet ;
+            struct sr_packet* first;
+            uint32_t srcs[SR_ARPREQ_BURST];
+            const struct sr_nexthop *nhs[SR_ARPREQ_BURST];
+            int npkts, i;
 
-            /*handle each sr packet */
-            for(wait_packet=request->packets; wait_packet != NULL; wait_packet = wait_packet ->next){
-                /*get ip header from raw Ethernet*/
-             
-                struct sr_ip_hdr* ip_header = (struct sr_ip_hdr*)(wait_packet->buf+ sizeof( struct sr_ethernet_hdr));
-                uint32_t ip_dest = ip_header -> ip_src;
-		
-                /*go through interface list, find outer inteface with ip address by longest prefix match */
-                struct sr_rt* rtable = sr_longest_prefix_match(sr, ip_dest);
-               
-                /*send imcp to source addr */
-                sr_icmp_dest_unreachable(sr, wait_packet->buf, wait_packet->len, rtable->interface, 3, 1);
-
-             
+            /* resolve the route back to the sources a burst at a time */
+            wait_packet = request->packets;
+            while (wait_packet != NULL) {
+                first = wait_packet;
+                for(npkts = 0; wait_packet != NULL && npkts < SR_ARPREQ_BURST; wait_packet = wait_packet ->next){
+                    /*get ip header from raw Ethernet*/
+                    struct sr_ip_hdr* ip_header = (struct sr_ip_hdr*)(wait_packet->buf+ sizeof( struct sr_ethernet_hdr));
+                    srcs[npkts++] = ip_header -> ip_src;
+                }
+                sr_fib_lookup_burst(sr->fib, srcs, NULL, npkts, nhs);
+
+                /*handle each sr packet */
+                for(i = 0; i < npkts; first = first->next, i++){
+                    if (!nhs[i]) {
+                        continue;
+                    }
+
+                    /*send imcp to source addr */
+                    sr_icmp_dest_unreachable(sr, first->buf, first->len, (char *)nhs[i]->interface, 3, 1);
+                }
             }
+
            /* destory arp request in the queue */
            sr_arpreq_destroy(&(sr->cache), request);
         }
@@ -145,6 +159,118 @@ uint8_t *construct_arp_buff(uint8_t *ifacemac, uint32_t ifaceip, uint32_t destip
             return arp_packet;
 }
 
+/* 
+   Adjacency table: hash of next hop -> prebuilt Ethernet header. See the
+   comment on struct sr_adj in sr_arpcache.h.
+*/
+static unsigned int sr_adj_hash(uint32_t ip) {
+    uint32_t h = ip * 2654435761U;
+    return (h >> 24) % SR_ADJ_BUCKETS;
+}
+
+/* Update the resolved state of adj. mac may be NULL when invalidating.
+   Caller holds the cache lock. */
+static void sr_adj_set(struct sr_adj *adj, const unsigned char *mac, int valid) {
+    adj->seq++;
+    __sync_synchronize();
+    if (mac) {
+        memcpy(adj->hdr.ether_dhost, mac, ETHER_ADDR_LEN);
+    }
+    adj->valid = valid;
+    adj->added = time(NULL);
+    __sync_synchronize();
+    adj->seq++;
+}
+
+/* Patch every adjacency towards ip with its new MAC. Caller holds the
+   cache lock. */
+static void sr_adj_resolve(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac) {
+    struct sr_adj *adj;
+    for (adj = cache->adjs[sr_adj_hash(ip)]; adj != NULL; adj = adj->next) {
+        if (adj->ip == ip) {
+            sr_adj_set(adj, mac, 1);
+        }
+    }
+}
+
+struct sr_adj *sr_adj_get(struct sr_arpcache *cache, uint32_t ip,
+                          struct sr_if *iface) {
+    pthread_mutex_lock(&(cache->lock));
+
+    unsigned int bucket = sr_adj_hash(ip);
+    struct sr_adj *adj;
+    for (adj = cache->adjs[bucket]; adj != NULL; adj = adj->next) {
+        if ((adj->ip == ip) && (adj->iface == iface)) {
+            break;
+        }
+    }
+
+    if (!adj) {
+        adj = (struct sr_adj *)calloc(1, sizeof(struct sr_adj));
+        if (!adj) {
+            /* the next hop goes through the arp request queue instead */
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
+        adj->ip = ip;
+        adj->iface = iface;
+        memcpy(adj->hdr.ether_shost, iface->addr, ETHER_ADDR_LEN);
+        adj->hdr.ether_type = htons(ethertype_ip);
+
+        /* the next hop may already be in the cache */
+        int i;
+        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+            if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
+                memcpy(adj->hdr.ether_dhost, cache->entries[i].mac, ETHER_ADDR_LEN);
+                adj->added = cache->entries[i].added;
+                adj->valid = 1;
+            }
+        }
+
+        /* fully built before it becomes reachable */
+        __sync_synchronize();
+        adj->next = cache->adjs[bucket];
+        cache->adjs[bucket] = adj;
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return adj;
+}
+
+int sr_adj_write_hdr(const struct sr_adj *adj, uint8_t *frame) {
+    unsigned int seq;
+    int valid;
+
+    if (!adj) {
+        return 0;
+    }
+
+    /* retry if an ARP update ran while we were copying */
+    do {
+        seq = adj->seq;
+        __sync_synchronize();
+        valid = adj->valid;
+        if (valid) {
+            memcpy(frame, &(adj->hdr), sizeof(sr_ethernet_hdr_t));
+        }
+        __sync_synchronize();
+    } while ((seq & 1) || (seq != adj->seq));
+
+    return valid;
+}
+
+void sr_arpcache_bind_fib(struct sr_arpcache *cache, struct sr_fib *fib) {
+    if (!fib) {
+        return;
+    }
+
+    int32_t i;
+    for (i = 0; i < fib->nnexthops; i++) {
+        struct sr_nexthop *nh = &(fib->nexthops[i]);
+        nh->adj = nh->iface ? sr_adj_get(cache, nh->gw.s_addr, nh->iface) : NULL;
+    }
+}
 
 
 
@@ -186,7 +312,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       const char *iface)
 {
     pthread_mutex_lock(&(cache->lock));
     printf("21\n");
@@ -268,6 +394,9 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
     }
+
+    /* patch adjacencies in place, even if the cache itself was full */
+    sr_adj_resolve(cache, ip, mac);
     
     pthread_mutex_unlock(&(cache->lock));
     
@@ -336,6 +465,7 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
+    memset(cache->adjs, 0, sizeof(cache->adjs));
     cache->requests = NULL;
     
     /* Acquire mutex lock */
@@ -370,10 +500,23 @@ void *sr_arpcache_timeout(void *sr_ptr) {
                 cache->entries[i].valid = 0;
             }
         }
+
+        /* adjacencies age out like the entries they were resolved from */
+        for (i = 0; i < SR_ADJ_BUCKETS; i++) {
+            struct sr_adj *adj;
+            for (adj = cache->adjs[i]; adj != NULL; adj = adj->next) {
+                if ((adj->valid) && (difftime(curtime, adj->added) > SR_ARPCACHE_TO)) {
+                    sr_adj_set(adj, NULL, 0);
+                }
+            }
+        }
         
         sr_arpcache_sweepreqs(sr);
 
         pthread_mutex_unlock(&(cache->lock));
+
+        /* outside the cache lock: this runs packets through the router */
+        sr_syn_pending_sweep(sr);
     }
     
     return NULL;
@@ -73,6 +73,8 @@
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ADJ_BUCKETS    256
+#define SR_ARPREQ_BURST   32   /* waiting packets answered per fib burst */
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
@@ -99,9 +101,29 @@ struct sr_arpreq {
     struct sr_arpreq *next;
 };
 
+/* An adjacency is the resolved link layer rewrite for one next hop: the
+   complete Ethernet header a forwarded packet gets (next hop MAC, egress
+   interface MAC, IP ethertype).  FIB next hops point at their adjacency,
+   so forwarding is one lookup plus one 14 byte copy.  Adjacencies are
+   created when a FIB is bound to the interfaces, are never freed (a
+   reloaded FIB picks up the same ones), and are patched in place by ARP
+   replies and expired by the cache timeout thread.  Writers hold the
+   cache lock; readers go lock free through the seq counter, which is odd
+   while an update is in progress. */
+struct sr_adj {
+    uint32_t ip;                /* next hop, network byte order */
+    struct sr_if *iface;        /* egress interface */
+    volatile unsigned int seq;
+    volatile int valid;         /* hdr.ether_dhost is resolved */
+    time_t added;
+    sr_ethernet_hdr_t hdr;
+    struct sr_adj *next;        /* hash chain */
+};
+
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    struct sr_adj *adjs[SR_ADJ_BUCKETS];
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -121,7 +143,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         const char *iface);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
@@ -131,6 +153,23 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip);
 
+/* Returns the adjacency for next hop ip out of iface, creating it (and
+   resolving it from the cache if the MAC is already known) if needed.
+   NULL if it cannot be allocated; sr_adj_write_hdr treats that as an
+   unresolved next hop. */
+struct sr_adj *sr_adj_get(struct sr_arpcache *cache, uint32_t ip,
+                          struct sr_if *iface);
+
+/* Writes the adjacency's Ethernet header to the start of frame. Returns 1
+   if it did, 0 if adj is NULL or the next hop MAC is not resolved. Lock
+   free. */
+int sr_adj_write_hdr(const struct sr_adj *adj, uint8_t *frame);
+
+/* Points every next hop of fib that has an egress interface at its
+   adjacency. Call after sr_fib_bind_interfaces. */
+struct sr_fib;
+void sr_arpcache_bind_fib(struct sr_arpcache *cache, struct sr_fib *fib);
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
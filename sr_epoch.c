@@ -0,0 +1,78 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.c
+ *
+ * Description:
+ *
+ * Two slot reader counting used to delay frees until concurrent readers
+ * are done.  See sr_epoch.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sr_epoch.h"
+
+#define EPOCH_WAIT_US 100
+
+void sr_epoch_init(struct sr_epoch* epoch)
+{
+    epoch->gen = 0;
+    epoch->readers[0] = 0;
+    epoch->readers[1] = 0;
+    pthread_mutex_init(&(epoch->lock), NULL);
+} /* -- sr_epoch_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_enter
+ * Scope:  Global
+ *
+ * Start a read-side critical section.  Returns the slot that must be
+ * handed back to sr_epoch_exit.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_epoch_enter(struct sr_epoch* epoch)
+{
+    int slot = (int)(epoch->gen & 1);
+
+    /* full barrier: the count is visible before any protected load */
+    __sync_fetch_and_add(&(epoch->readers[slot]), 1);
+
+    return slot;
+} /* -- sr_epoch_enter -- */
+
+void sr_epoch_exit(struct sr_epoch* epoch, int slot)
+{
+    /* full barrier: protected loads complete before the count drops */
+    __sync_fetch_and_sub(&(epoch->readers[slot]), 1);
+} /* -- sr_epoch_exit -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_synchronize
+ * Scope:  Global
+ *
+ * Wait until every read-side critical section that started before this
+ * call has ended.  The caller must already have unpublished whatever it
+ * intends to free.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_synchronize(struct sr_epoch* epoch)
+{
+    int pass;
+
+    pthread_mutex_lock(&(epoch->lock));
+
+    __sync_synchronize();
+    for(pass = 0; pass < 2; pass++)
+    {
+        int slot = (int)(epoch->gen & 1);
+
+        __sync_fetch_and_add(&(epoch->gen), 1);
+        while(epoch->readers[slot] != 0)
+        { usleep(EPOCH_WAIT_US); }
+    }
+
+    pthread_mutex_unlock(&(epoch->lock));
+} /* -- sr_epoch_synchronize -- */
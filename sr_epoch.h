@@ -0,0 +1,37 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.h
+ *
+ * Description:
+ *
+ * Grace period tracking for structures that are read without locks and
+ * replaced by publishing a new pointer.  Readers bracket their accesses
+ * with sr_epoch_enter/sr_epoch_exit; a writer swaps the pointer, calls
+ * sr_epoch_synchronize and may then free the old version, since every
+ * reader that could still see it has left.
+ *
+ * Readers are counted in one of two slots chosen by the current
+ * generation.  synchronize flips the generation twice and waits for each
+ * slot to drain, so a reader that raced with the first flip is caught by
+ * the second.  Read-side critical sections are meant to be short (one
+ * packet); writers are rare and may sleep.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_EPOCH_H
+#define sr_EPOCH_H
+
+#include <pthread.h>
+
+struct sr_epoch
+{
+    volatile unsigned long gen;
+    volatile long readers[2];
+    pthread_mutex_t lock;   /* serializes writers */
+};
+
+void sr_epoch_init(struct sr_epoch* epoch);
+int  sr_epoch_enter(struct sr_epoch* epoch);
+void sr_epoch_exit(struct sr_epoch* epoch, int slot);
+void sr_epoch_synchronize(struct sr_epoch* epoch);
+
+#endif  /* --  sr_EPOCH_H -- */
@@ -0,0 +1,1310 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Longest prefix match engines.  The trie is path-compressed (Patricia):
+ * every node carries the full key prefix it represents, so single-child
+ * chains collapse into one node and a lookup visits at most 33 nodes
+ * regardless of how many routes are loaded.  DIR-24-8 expands every
+ * prefix into a 2^24 entry table indexed by the top 24 address bits, with
+ * 256 entry second level groups for prefixes longer than /24.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+
+#define FIB_INIT_NODES 64
+#define FIB_BURST      32  /* lookups interleaved by sr_fib_lookup_burst */
+
+/* mask for the top plen bits of a host order address */
+#define FIB_MASK(plen) ((plen) ? (0xffffffffU << (32 - (plen))) : 0)
+/* bit number pos (0 = most significant) of a host order address */
+#define FIB_BIT(addr, pos) (((addr) >> (31 - (pos))) & 1)
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_mask_len
+ * Scope:  Local
+ *
+ * Number of leading one bits in a network byte order netmask.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_mask_len(uint32_t mask_nbo)
+{
+    uint32_t mask = ntohl(mask_nbo);
+    int len = 0;
+
+    while(len < 32 && (mask & (0x80000000U >> len)))
+    { len++; }
+
+    return len;
+} /* -- sr_fib_mask_len -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_common_len
+ * Scope:  Local
+ *
+ * Length of the common leading bits of a and b, capped at max.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_common_len(uint32_t a, uint32_t b, int max)
+{
+    uint32_t diff = a ^ b;
+    int len = diff ? __builtin_clz(diff) : 32;
+
+    return len < max ? len : max;
+} /* -- sr_fib_common_len -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_new_node
+ * Scope:  Local
+ *
+ * Append a node to the node array and return its index.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_new_node(struct sr_fib* fib, uint32_t prefix,
+                               int plen, int32_t group)
+{
+    struct sr_fib_node* node;
+
+    if(fib->nnodes == fib->cap)
+    {
+        fib->cap *= 2;
+        fib->nodes = (struct sr_fib_node*)realloc(fib->nodes,
+                fib->cap * sizeof(struct sr_fib_node));
+        assert(fib->nodes);
+    }
+
+    node = &fib->nodes[fib->nnodes];
+    node->prefix   = prefix & FIB_MASK(plen);
+    node->plen     = (uint8_t)plen;
+    node->child[0] = -1;
+    node->child[1] = -1;
+    node->group    = group;
+
+    return fib->nnodes++;
+} /* -- sr_fib_new_node -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert
+ * Scope:  Local
+ *
+ * Insert prefix/plen pointing at group.  Routes for an identical prefix
+ * share one group, so inserting it again changes nothing.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_insert(struct sr_fib* fib, uint32_t prefix, int plen,
+                          int32_t group)
+{
+    int32_t  parent = -1; /* node owning the link we follow, -1 = root */
+    int      side = 0;
+    int32_t  cur = fib->root;
+    int32_t  split = -1;
+
+    prefix &= FIB_MASK(plen);
+
+    while(cur != -1)
+    {
+        struct sr_fib_node* node = &fib->nodes[cur];
+        int common = sr_fib_common_len(prefix, node->prefix,
+                plen < node->plen ? plen : node->plen);
+
+        if(common < node->plen)
+        {
+            /* -- prefix diverges inside this node's key, split it -- */
+            if(common == plen)
+            {
+                split = sr_fib_new_node(fib, prefix, plen, group);
+            }
+            else
+            {
+                int32_t leaf;
+                split = sr_fib_new_node(fib, prefix, common, -1);
+                leaf  = sr_fib_new_node(fib, prefix, plen, group);
+                fib->nodes[split].child[FIB_BIT(prefix, common)] = leaf;
+            }
+            fib->nodes[split].child[FIB_BIT(fib->nodes[cur].prefix, common)]
+                = cur;
+            break;
+        }
+
+        if(plen == node->plen)
+        {
+            node->group = group;
+            return;
+        }
+
+        parent = cur;
+        side   = FIB_BIT(prefix, node->plen);
+        cur    = node->child[side];
+    }
+
+    if(cur == -1)
+    { split = sr_fib_new_node(fib, prefix, plen, group); }
+
+    if(parent == -1)
+    { fib->root = split; }
+    else
+    { fib->nodes[parent].child[side] = split; }
+} /* -- sr_fib_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build_trie
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_build_trie(struct sr_fib* fib)
+{
+    int32_t i;
+
+    fib->cap    = FIB_INIT_NODES;
+    fib->nnodes = 0;
+    fib->root   = -1;
+    fib->nodes  = (struct sr_fib_node*)malloc(
+            fib->cap * sizeof(struct sr_fib_node));
+    assert(fib->nodes);
+
+    for(i = 0; i < fib->nroutes; i++)
+    {
+        sr_fib_insert(fib, ntohl(fib->routes[i].dest),
+                sr_fib_mask_len(fib->routes[i].mask), fib->routes[i].group);
+    }
+} /* -- sr_fib_build_trie -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dir24_group
+ * Scope:  Local
+ *
+ * Return the tbl8 group behind tbl24 slot idx, creating it (seeded with
+ * the slot's current value) if the slot is not extended yet.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_dir24_group(struct sr_fib* fib, uint32_t idx)
+{
+    uint32_t entry = fib->tbl24[idx];
+    uint32_t group;
+    int i;
+
+    if(entry & FIB_DIR24_EXT)
+    { return entry & ~FIB_DIR24_EXT; }
+
+    if(fib->ntbl8 == fib->tbl8_cap)
+    {
+        fib->tbl8_cap = fib->tbl8_cap ? fib->tbl8_cap * 2 : 64;
+        fib->tbl8 = (uint32_t*)realloc(fib->tbl8,
+                fib->tbl8_cap * FIB_TBL8_GROUP * sizeof(uint32_t));
+        assert(fib->tbl8);
+    }
+
+    group = fib->ntbl8++;
+    for(i = 0; i < FIB_TBL8_GROUP; i++)
+    { fib->tbl8[group * FIB_TBL8_GROUP + i] = entry; }
+    fib->tbl24[idx] = group | FIB_DIR24_EXT;
+
+    return group;
+} /* -- sr_fib_dir24_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build_dir24
+ * Scope:  Local
+ *
+ * Routes are written shortest prefix first so longer prefixes overwrite
+ * the ranges they cover.  All /0-/24 routes are
+ * written before any tbl8 group exists, so those writes never have to
+ * look behind an extended slot.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_build_dir24(struct sr_fib* fib)
+{
+    int32_t* by_len;
+    int32_t  start[34];
+    int32_t  fill[33];
+    int32_t  i;
+    int      len;
+
+    fib->tbl24 = (uint32_t*)calloc(FIB_TBL24_SIZE, sizeof(uint32_t));
+    assert(fib->tbl24);
+    fib->tbl8     = 0;
+    fib->ntbl8    = 0;
+    fib->tbl8_cap = 0;
+
+    /* -- counting sort of route indices by prefix length -- */
+    by_len = (int32_t*)malloc((fib->nroutes ? fib->nroutes : 1)
+            * sizeof(int32_t));
+    assert(by_len);
+    memset(start, 0, sizeof(start));
+    for(i = 0; i < fib->nroutes; i++)
+    { start[sr_fib_mask_len(fib->routes[i].mask) + 1]++; }
+    for(len = 0; len < 33; len++)
+    {
+        start[len + 1] += start[len];
+        fill[len] = start[len];
+    }
+    for(i = 0; i < fib->nroutes; i++)
+    { by_len[fill[sr_fib_mask_len(fib->routes[i].mask)]++] = i; }
+
+    for(len = 0; len <= 32; len++)
+    {
+        for(i = start[len]; i < start[len + 1]; i++)
+        {
+            const struct sr_fib_route* route = &fib->routes[by_len[i]];
+            uint32_t prefix = ntohl(route->dest) & FIB_MASK(len);
+            uint32_t first, count, j;
+
+            if(len <= 24)
+            {
+                first = prefix >> 8;
+                count = 1U << (24 - len);
+                for(j = 0; j < count; j++)
+                { fib->tbl24[first + j] = route->group + 1; }
+            }
+            else
+            {
+                uint32_t group = sr_fib_dir24_group(fib, prefix >> 8);
+                first = group * FIB_TBL8_GROUP + (prefix & 0xff);
+                count = 1U << (32 - len);
+                for(j = 0; j < count; j++)
+                { fib->tbl8[first + j] = route->group + 1; }
+            }
+        }
+    }
+
+    free(by_len);
+} /* -- sr_fib_build_dir24 -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_engine_from_name
+ * Scope:  Global
+ *
+ * Map an engine name given on the command line to its enum value,
+ * -1 if the name is unknown.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_engine_from_name(const char* name)
+{
+    int engine;
+
+    for(engine = sr_fib_linear; engine <= sr_fib_dir24; engine++)
+    {
+        if(strcmp(name, sr_fib_engine_name(engine)) == 0)
+        { return engine; }
+    }
+
+    return -1;
+} /* -- sr_fib_engine_from_name -- */
+
+const char* sr_fib_engine_name(enum sr_fib_engine engine)
+{
+    switch(engine)
+    {
+        case sr_fib_linear: return "linear";
+        case sr_fib_trie:   return "trie";
+        case sr_fib_dir24:  return "dir24";
+    }
+    return "unknown";
+} /* -- sr_fib_engine_name -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_nexthop
+ * Scope:  Local
+ *
+ * Return the index of the (gw, interface) next hop, adding it if it is
+ * new.  hash is an open addressed table of nexthop index + 1 with
+ * hash_size (a power of two) slots, only used while building.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_add_nexthop(struct sr_fib* fib, int32_t* hash,
+                                  uint32_t hash_size, const struct sr_rt* rt)
+{
+    uint32_t slot = rt->gw.s_addr * 2654435761U;
+    const char* c;
+    struct sr_nexthop* nh;
+
+    for(c = rt->interface; *c && c < rt->interface + sr_IFACE_NAMELEN; c++)
+    { slot = slot * 31 + (unsigned char)*c; }
+
+    for(slot &= hash_size - 1; hash[slot]; slot = (slot + 1) & (hash_size - 1))
+    {
+        nh = &fib->nexthops[hash[slot] - 1];
+        if(nh->gw.s_addr == rt->gw.s_addr &&
+           strncmp(nh->interface, rt->interface, sr_IFACE_NAMELEN) == 0)
+        { return hash[slot] - 1; }
+    }
+
+    nh = &fib->nexthops[fib->nnexthops];
+    nh->gw = rt->gw;
+    strncpy(nh->interface, rt->interface, sr_IFACE_NAMELEN);
+    nh->interface[sr_IFACE_NAMELEN - 1] = 0;
+    nh->iface = 0;
+    nh->adj = 0;
+    hash[slot] = ++fib->nnexthops;
+
+    return hash[slot] - 1;
+} /* -- sr_fib_add_nexthop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_group
+ * Scope:  Local
+ *
+ * Return the group of route r's prefix, adding a group if the prefix is
+ * new, and count r towards its size.  hash holds the index + 1 of the
+ * first route seen for each prefix, same layout as in
+ * sr_fib_add_nexthop.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_add_group(struct sr_fib* fib, int32_t* hash,
+                                uint32_t hash_size, int32_t r)
+{
+    const struct sr_fib_route* route = &fib->routes[r];
+    uint32_t dest = route->dest & route->mask;
+    uint32_t slot = (dest ^ (route->mask * 31)) * 2654435761U;
+    int32_t  group;
+
+    for(slot &= hash_size - 1; hash[slot]; slot = (slot + 1) & (hash_size - 1))
+    {
+        const struct sr_fib_route* first = &fib->routes[hash[slot] - 1];
+        if(first->mask == route->mask &&
+           (first->dest & first->mask) == dest)
+        {
+            fib->groups[first->group].count++;
+            return first->group;
+        }
+    }
+
+    hash[slot] = r + 1;
+    group = fib->ngroups++;
+    fib->groups[group].first = 0;
+    fib->groups[group].count = 1;
+
+    return group;
+} /* -- sr_fib_add_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build_groups
+ * Scope:  Local
+ *
+ * Lay out the members of every group (counted by sr_fib_add_group) in
+ * list order.  nh_of holds the next hop of each route; a route that
+ * repeats a next hop already in its group is dropped.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_build_groups(struct sr_fib* fib, const int32_t* nh_of)
+{
+    int32_t first = 0;
+    int32_t i, j;
+
+    for(i = 0; i < fib->ngroups; i++)
+    {
+        fib->groups[i].first = first;
+        first += fib->groups[i].count;
+        fib->groups[i].count = 0;
+    }
+
+    for(i = 0; i < fib->nroutes; i++)
+    {
+        struct sr_fib_group* group = &fib->groups[fib->routes[i].group];
+        int32_t* members = &fib->members[group->first];
+
+        for(j = 0; j < group->count && members[j] != nh_of[i]; j++);
+        if(j == group->count)
+        { members[group->count++] = nh_of[i]; }
+    }
+
+    fib->nmembers = first;
+} /* -- sr_fib_build_groups -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build
+ * Scope:  Global
+ *
+ * Compile the routing table list into a new FIB using the given lookup
+ * engine.  The FIB copies what it needs, so the list may be changed or
+ * freed afterwards.  Interfaces must be bound separately (see
+ * sr_fib_bind_interfaces) because they may not be known yet.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_build(struct sr_rt* rt_list, enum sr_fib_engine engine)
+{
+    struct sr_fib* fib;
+    struct sr_rt* rt_walker;
+    int32_t* hash;
+    int32_t* ghash;
+    int32_t* nh_of;
+    uint32_t hash_size;
+    int32_t i, n;
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    assert(fib);
+
+    fib->engine = engine;
+    fib->root   = -1;
+
+    fib->nroutes = 0;
+    for(rt_walker = rt_list; rt_walker; rt_walker = rt_walker->next)
+    { fib->nroutes++; }
+
+    n = fib->nroutes ? fib->nroutes : 1;
+    fib->routes   = (struct sr_fib_route*)malloc(n * sizeof(struct sr_fib_route));
+    fib->nexthops = (struct sr_nexthop*)malloc(n * sizeof(struct sr_nexthop));
+    fib->groups   = (struct sr_fib_group*)malloc(n * sizeof(struct sr_fib_group));
+    fib->members  = (int32_t*)malloc(n * sizeof(int32_t));
+    nh_of = (int32_t*)malloc(n * sizeof(int32_t));
+    assert(fib->routes);
+    assert(fib->nexthops);
+    assert(fib->groups);
+    assert(fib->members);
+    assert(nh_of);
+
+    for(hash_size = 16; hash_size < 2 * (uint32_t)fib->nroutes; hash_size *= 2);
+    hash  = (int32_t*)calloc(hash_size, sizeof(int32_t));
+    ghash = (int32_t*)calloc(hash_size, sizeof(int32_t));
+    assert(hash);
+    assert(ghash);
+
+    i = 0;
+    for(rt_walker = rt_list; rt_walker; rt_walker = rt_walker->next, i++)
+    {
+        /* host bits of the destination are ignored, as the trie and
+           dir24 engines do */
+        fib->routes[i].dest  = rt_walker->dest.s_addr & rt_walker->mask.s_addr;
+        fib->routes[i].mask  = rt_walker->mask.s_addr;
+        nh_of[i] = sr_fib_add_nexthop(fib, hash, hash_size, rt_walker);
+        fib->routes[i].group = sr_fib_add_group(fib, ghash, hash_size, i);
+    }
+    free(hash);
+    free(ghash);
+
+    sr_fib_build_groups(fib, nh_of);
+    free(nh_of);
+
+    if(fib->nnexthops)
+    {
+        fib->nexthops = (struct sr_nexthop*)realloc(fib->nexthops,
+                fib->nnexthops * sizeof(struct sr_nexthop));
+        assert(fib->nexthops);
+    }
+    if(fib->ngroups)
+    {
+        fib->groups = (struct sr_fib_group*)realloc(fib->groups,
+                fib->ngroups * sizeof(struct sr_fib_group));
+        assert(fib->groups);
+    }
+
+    switch(engine)
+    {
+        case sr_fib_linear:
+            break;
+        case sr_fib_trie:
+            sr_fib_build_trie(fib);
+            break;
+        case sr_fib_dir24:
+            sr_fib_build_dir24(fib);
+            break;
+    }
+
+    return fib;
+} /* -- sr_fib_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_bind_interfaces
+ * Scope:  Global
+ *
+ * Resolve the egress interface of every next hop by name so the
+ * forwarding path does not have to.  Call again whenever the interface
+ * list changes, followed by sr_arpcache_bind_fib to refresh the
+ * adjacencies.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_bind_interfaces(struct sr_fib* fib, struct sr_if* if_list)
+{
+    int32_t i;
+    struct sr_if* if_walker;
+
+    if(fib == 0)
+    { return; }
+
+    for(i = 0; i < fib->nnexthops; i++)
+    {
+        fib->nexthops[i].iface = 0;
+        for(if_walker = if_list; if_walker; if_walker = if_walker->next)
+        {
+            if(strncmp(if_walker->name, fib->nexthops[i].interface,
+                       sr_IFACE_NAMELEN) == 0)
+            {
+                fib->nexthops[i].iface = if_walker;
+                break;
+            }
+        }
+    }
+} /* -- sr_fib_bind_interfaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_destroy
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    if(fib == 0)
+    { return; }
+
+    if(fib->map)
+    {
+        /* -- tables live in the mapping, only next hops are ours -- */
+        munmap(fib->map, fib->map_len);
+    }
+    else
+    {
+        free(fib->nodes);
+        free(fib->tbl24);
+        free(fib->tbl8);
+        free(fib->routes);
+        free(fib->groups);
+        free(fib->members);
+    }
+    free(fib->nexthops);
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_memory
+ * Scope:  Global
+ *
+ * Bytes used by the FIB's tables, whether allocated or mapped.
+ *
+ *---------------------------------------------------------------------*/
+
+size_t sr_fib_memory(const struct sr_fib* fib)
+{
+    size_t bytes;
+
+    if(fib == 0)
+    { return 0; }
+
+    bytes = sizeof(struct sr_fib)
+          + fib->nroutes   * sizeof(struct sr_fib_route)
+          + fib->nnexthops * sizeof(struct sr_nexthop)
+          + fib->ngroups   * sizeof(struct sr_fib_group)
+          + fib->nmembers  * sizeof(int32_t);
+
+    if(fib->engine == sr_fib_trie)
+    { bytes += fib->nnodes * sizeof(struct sr_fib_node); }
+    if(fib->engine == sr_fib_dir24)
+    {
+        bytes += (size_t)FIB_TBL24_SIZE * sizeof(uint32_t)
+               + (size_t)fib->ntbl8 * FIB_TBL8_GROUP * sizeof(uint32_t);
+    }
+
+    return bytes;
+} /* -- sr_fib_memory -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_linear
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_lookup_linear(const struct sr_fib* fib, uint32_t ip)
+{
+    const struct sr_fib_route* best = 0;
+    int32_t i;
+
+    for(i = 0; i < fib->nroutes; i++)
+    {
+        const struct sr_fib_route* rt = &fib->routes[i];
+        if(((ip & rt->mask) == rt->dest) &&
+           (best == 0 || rt->mask >= best->mask))
+        { best = rt; }
+    }
+
+    return best ? best->group : -1;
+} /* -- sr_fib_lookup_linear -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_trie
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_lookup_trie(const struct sr_fib* fib, uint32_t ip)
+{
+    uint32_t addr = ntohl(ip);
+    int32_t  cur = fib->root;
+    int32_t  best = -1;
+
+    while(cur != -1)
+    {
+        const struct sr_fib_node* node = &fib->nodes[cur];
+
+        if((addr & FIB_MASK(node->plen)) != node->prefix)
+        { break; }
+        if(node->group != -1)
+        { best = node->group; }
+        if(node->plen == 32)
+        { break; }
+
+        cur = node->child[FIB_BIT(addr, node->plen)];
+    }
+
+    return best;
+} /* -- sr_fib_lookup_trie -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_dir24
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_lookup_dir24(const struct sr_fib* fib, uint32_t ip)
+{
+    uint32_t addr = ntohl(ip);
+    uint32_t entry = fib->tbl24[addr >> 8];
+
+    if(entry & FIB_DIR24_EXT)
+    {
+        entry = fib->tbl8[(entry & ~FIB_DIR24_EXT) * FIB_TBL8_GROUP
+                          + (addr & 0xff)];
+    }
+
+    return (int32_t)entry - 1;
+} /* -- sr_fib_lookup_dir24 -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_group
+ * Scope:  Local
+ *
+ * Group of the longest matching prefix for ip, -1 if none.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_lookup_group(const struct sr_fib* fib, uint32_t ip)
+{
+    switch(fib->engine)
+    {
+        case sr_fib_linear: return sr_fib_lookup_linear(fib, ip);
+        case sr_fib_trie:   return sr_fib_lookup_trie(fib, ip);
+        case sr_fib_dir24:  return sr_fib_lookup_dir24(fib, ip);
+    }
+    return -1;
+} /* -- sr_fib_lookup_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_group_member
+ * Scope:  Local
+ *
+ * Next hop of group g (-1 = no route) for the given flow hash.
+ *
+ *---------------------------------------------------------------------*/
+
+static const struct sr_nexthop* sr_fib_group_member(const struct sr_fib* fib,
+                                                    int32_t g, uint32_t flow)
+{
+    const struct sr_fib_group* group;
+
+    if(g < 0)
+    { return 0; }
+
+    group = &fib->groups[g];
+    if(group->count == 1)
+    { return &fib->nexthops[fib->members[group->first]]; }
+
+    return &fib->nexthops[fib->members[group->first +
+                                       flow % (uint32_t)group->count]];
+} /* -- sr_fib_group_member -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_flow
+ * Scope:  Global
+ *
+ * Longest prefix match for ip (network byte order).  Returns the next
+ * hop of the matching route, or 0 if nothing matches.  If the prefix has
+ * several equal cost next hops, flow (a hash of the packet's addresses
+ * and ports) picks one, so a flow always gets the same one.  The handle
+ * stays valid for as long as the FIB does and must not be freed.
+ *
+ *---------------------------------------------------------------------*/
+
+const struct sr_nexthop* sr_fib_lookup_flow(const struct sr_fib* fib,
+                                            uint32_t ip, uint32_t flow)
+{
+    if(fib == 0)
+    { return 0; }
+
+    return sr_fib_group_member(fib, sr_fib_lookup_group(fib, ip), flow);
+} /* -- sr_fib_lookup_flow -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup
+ * Scope:  Global
+ *
+ * sr_fib_lookup_flow for callers without a flow, e.g. replies generated
+ * by the router itself.  Always takes the first next hop of a group.
+ *
+ *---------------------------------------------------------------------*/
+
+const struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip)
+{
+    return sr_fib_lookup_flow(fib, ip, 0);
+} /* -- sr_fib_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_burst_trie
+ * Scope:  Local
+ *
+ * Walk the trie for up to FIB_BURST addresses at once.  Each round moves
+ * every unfinished walk down one node and prefetches the node it will
+ * read next round, so the cache misses of the whole burst overlap
+ * instead of being paid one after the other.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_burst_trie(const struct sr_fib* fib, const uint32_t* ips,
+                              int n, int32_t* groups)
+{
+    uint32_t addr[FIB_BURST];
+    int32_t  cur[FIB_BURST];
+    int      active = n;
+    int      i;
+
+    for(i = 0; i < n; i++)
+    {
+        addr[i]   = ntohl(ips[i]);
+        cur[i]    = fib->root;
+        groups[i] = -1;
+        if(cur[i] != -1)
+        { __builtin_prefetch(&fib->nodes[cur[i]]); }
+        else
+        { active--; }
+    }
+
+    while(active)
+    {
+        for(i = 0; i < n; i++)
+        {
+            const struct sr_fib_node* node;
+
+            if(cur[i] == -1)
+            { continue; }
+
+            node = &fib->nodes[cur[i]];
+            if((addr[i] & FIB_MASK(node->plen)) != node->prefix)
+            { cur[i] = -1; active--; continue; }
+            if(node->group != -1)
+            { groups[i] = node->group; }
+            if(node->plen == 32)
+            { cur[i] = -1; active--; continue; }
+
+            cur[i] = node->child[FIB_BIT(addr[i], node->plen)];
+            if(cur[i] == -1)
+            { active--; }
+            else
+            { __builtin_prefetch(&fib->nodes[cur[i]]); }
+        }
+    }
+} /* -- sr_fib_burst_trie -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_burst_dir24
+ * Scope:  Local
+ *
+ * Prefetch every tbl24 slot of the burst, then read them; slots that
+ * point to a tbl8 group get a second prefetch-then-read pass.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_burst_dir24(const struct sr_fib* fib, const uint32_t* ips,
+                               int n, int32_t* groups)
+{
+    uint32_t entry[FIB_BURST];
+    uint8_t  is_ext[FIB_BURST];
+    int      ext = 0;
+    int      i;
+
+    for(i = 0; i < n; i++)
+    { __builtin_prefetch(&fib->tbl24[ntohl(ips[i]) >> 8]); }
+
+    for(i = 0; i < n; i++)
+    {
+        entry[i]  = fib->tbl24[ntohl(ips[i]) >> 8];
+        is_ext[i] = (entry[i] & FIB_DIR24_EXT) != 0;
+        if(is_ext[i])
+        {
+            entry[i] = (entry[i] & ~FIB_DIR24_EXT) * FIB_TBL8_GROUP
+                       + (ntohl(ips[i]) & 0xff);
+            __builtin_prefetch(&fib->tbl8[entry[i]]);
+            ext = 1;
+        }
+        else
+        { groups[i] = (int32_t)entry[i] - 1; }
+    }
+
+    if(!ext)
+    { return; }
+
+    for(i = 0; i < n; i++)
+    {
+        if(is_ext[i])
+        { groups[i] = (int32_t)fib->tbl8[entry[i]] - 1; }
+    }
+} /* -- sr_fib_burst_dir24 -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_burst
+ * Scope:  Global
+ *
+ * sr_fib_lookup_flow for n addresses at once: nhs[i] gets the next hop
+ * for ips[i] (0 if there is no route).  flows may be 0, which picks the
+ * first member of multipath groups like sr_fib_lookup.  Much faster per
+ * address than separate calls once the tables do not fit in cache,
+ * because the memory accesses of a burst are overlapped.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_lookup_burst(const struct sr_fib* fib, const uint32_t* ips,
+                         const uint32_t* flows, int n,
+                         const struct sr_nexthop** nhs)
+{
+    int32_t groups[FIB_BURST];
+    int base, count, i;
+
+    for(base = 0; base < n; base += FIB_BURST)
+    {
+        count = n - base < FIB_BURST ? n - base : FIB_BURST;
+
+        if(fib == 0)
+        {
+            for(i = 0; i < count; i++)
+            { nhs[base + i] = 0; }
+            continue;
+        }
+
+        switch(fib->engine)
+        {
+            case sr_fib_linear:
+                for(i = 0; i < count; i++)
+                { groups[i] = sr_fib_lookup_linear(fib, ips[base + i]); }
+                break;
+            case sr_fib_trie:
+                sr_fib_burst_trie(fib, ips + base, count, groups);
+                break;
+            case sr_fib_dir24:
+                sr_fib_burst_dir24(fib, ips + base, count, groups);
+                break;
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            nhs[base + i] = sr_fib_group_member(fib, groups[i],
+                    flows ? flows[base + i] : 0);
+        }
+    }
+} /* -- sr_fib_lookup_burst -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_rpf_check
+ * Scope:  Global
+ *
+ * Reverse path check of source address src (network byte order).  With
+ * iface 0 (loose mode) src only needs a usable route; otherwise (strict
+ * mode) one of the next hops of that route must leave through iface,
+ * i.e. the packet arrived on an interface we would use to reach its
+ * sender.  Returns 1 if the source passes.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_rpf_check(const struct sr_fib* fib, uint32_t src,
+                     const struct sr_if* iface)
+{
+    const struct sr_fib_group* group;
+    int32_t g, i;
+
+    if(fib == 0 || (g = sr_fib_lookup_group(fib, src)) < 0)
+    { return 0; }
+
+    group = &fib->groups[g];
+    for(i = 0; i < group->count; i++)
+    {
+        const struct sr_nexthop* nh =
+            &fib->nexthops[fib->members[group->first + i]];
+
+        if(nh->gw.s_addr && (iface == 0 || nh->iface == iface))
+        { return 1; }
+    }
+
+    return 0;
+} /* -- sr_fib_rpf_check -- */
+
+#define FIB_IMAGE_ALIGN(off) (((off) + 7) & ~(size_t)7)
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_layout
+ * Scope:  Local
+ *
+ * Compute the offset of each image section from the header counts and
+ * return the total image size.
+ *
+ *---------------------------------------------------------------------*/
+
+static size_t sr_fib_image_layout(const struct sr_fib_image_hdr* hdr,
+        size_t* routes_off, size_t* nh_off, size_t* groups_off,
+        size_t* members_off, size_t* nodes_off, size_t* tbl24_off,
+        size_t* tbl8_off)
+{
+    size_t off = FIB_IMAGE_ALIGN(sizeof(struct sr_fib_image_hdr));
+
+    *routes_off = off;
+    off = FIB_IMAGE_ALIGN(off + hdr->nroutes * sizeof(struct sr_fib_route));
+    *nh_off = off;
+    off = FIB_IMAGE_ALIGN(off + hdr->nnexthops * sizeof(struct sr_fib_image_nh));
+    *groups_off = off;
+    off = FIB_IMAGE_ALIGN(off + hdr->ngroups * sizeof(struct sr_fib_group));
+    *members_off = off;
+    off = FIB_IMAGE_ALIGN(off + hdr->nmembers * sizeof(int32_t));
+    *nodes_off = off;
+    if(hdr->engine == sr_fib_trie)
+    { off = FIB_IMAGE_ALIGN(off + hdr->nnodes * sizeof(struct sr_fib_node)); }
+    *tbl24_off = off;
+    if(hdr->engine == sr_fib_dir24)
+    { off += (size_t)FIB_TBL24_SIZE * sizeof(uint32_t); }
+    *tbl8_off = off;
+    if(hdr->engine == sr_fib_dir24)
+    { off += (size_t)hdr->ntbl8 * FIB_TBL8_GROUP * sizeof(uint32_t); }
+
+    return off;
+} /* -- sr_fib_image_layout -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_is_image
+ * Scope:  Global
+ *
+ * Returns 1 if filename starts with the FIB image magic.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_is_image(const char* filename)
+{
+    FILE* fp;
+    uint32_t magic = 0;
+    int ret;
+
+    if((fp = fopen(filename, "rb")) == 0)
+    { return 0; }
+    ret = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == FIB_IMAGE_MAGIC;
+    fclose(fp);
+
+    return ret;
+} /* -- sr_fib_is_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_write_at
+ * Scope:  Local
+ *
+ * Pad the file with zeros up to off, then write len bytes of buf.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_write_at(FILE* fp, size_t off, const void* buf, size_t len)
+{
+    static const char zeros[8];
+    long pos = ftell(fp);
+
+    if(pos < 0 || (size_t)pos > off || off - pos > sizeof(zeros))
+    { return -1; }
+    if(off > (size_t)pos && fwrite(zeros, off - pos, 1, fp) != 1)
+    { return -1; }
+    if(len && fwrite(buf, len, 1, fp) != 1)
+    { return -1; }
+
+    return 0;
+} /* -- sr_fib_write_at -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_save_image
+ * Scope:  Global
+ *
+ * Write fib to filename in the image format.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_save_image(const struct sr_fib* fib, const char* filename)
+{
+    struct sr_fib_image_hdr hdr;
+    struct sr_fib_image_nh  inh;
+    size_t routes_off, nh_off, groups_off, members_off, nodes_off;
+    size_t tbl24_off, tbl8_off, total;
+    FILE* fp;
+    int32_t i;
+    int err = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic     = FIB_IMAGE_MAGIC;
+    hdr.version   = FIB_IMAGE_VERSION;
+    hdr.engine    = fib->engine;
+    hdr.node_size = sizeof(struct sr_fib_node);
+    hdr.nroutes   = fib->nroutes;
+    hdr.nnexthops = fib->nnexthops;
+    hdr.ngroups   = fib->ngroups;
+    hdr.nmembers  = fib->nmembers;
+    hdr.nnodes    = fib->engine == sr_fib_trie ? fib->nnodes : 0;
+    hdr.root      = fib->root;
+    hdr.ntbl8     = fib->engine == sr_fib_dir24 ? fib->ntbl8 : 0;
+
+    total = sr_fib_image_layout(&hdr, &routes_off, &nh_off, &groups_off,
+                                &members_off, &nodes_off, &tbl24_off,
+                                &tbl8_off);
+
+    if((fp = fopen(filename, "wb")) == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    err |= sr_fib_write_at(fp, 0, &hdr, sizeof(hdr));
+    err |= sr_fib_write_at(fp, routes_off, fib->routes,
+                           fib->nroutes * sizeof(struct sr_fib_route));
+    for(i = 0; i < fib->nnexthops && !err; i++)
+    {
+        memset(&inh, 0, sizeof(inh));
+        inh.gw = fib->nexthops[i].gw.s_addr;
+        strncpy(inh.interface, fib->nexthops[i].interface, sr_IFACE_NAMELEN);
+        err |= sr_fib_write_at(fp, i ? (size_t)ftell(fp) : nh_off,
+                               &inh, sizeof(inh));
+    }
+    err |= sr_fib_write_at(fp, groups_off, fib->groups,
+                           fib->ngroups * sizeof(struct sr_fib_group));
+    err |= sr_fib_write_at(fp, members_off, fib->members,
+                           fib->nmembers * sizeof(int32_t));
+    if(fib->engine == sr_fib_trie)
+    {
+        err |= sr_fib_write_at(fp, nodes_off, fib->nodes,
+                               hdr.nnodes * sizeof(struct sr_fib_node));
+    }
+    if(fib->engine == sr_fib_dir24)
+    {
+        err |= sr_fib_write_at(fp, tbl24_off, fib->tbl24,
+                               (size_t)FIB_TBL24_SIZE * sizeof(uint32_t));
+        err |= sr_fib_write_at(fp, tbl8_off, fib->tbl8,
+                (size_t)hdr.ntbl8 * FIB_TBL8_GROUP * sizeof(uint32_t));
+    }
+    err |= sr_fib_write_at(fp, total, 0, 0);
+
+    if(fclose(fp) != 0 || err)
+    {
+        fprintf(stderr, "Error writing FIB image %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_fib_save_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_check
+ * Scope:  Local
+ *
+ * Check every index of a FIB mapped from an image against the array it
+ * points into, so the lookups never need to.  Trie children must have
+ * a longer prefix than their parent, which also rules out loops.
+ * Returns 0 if the FIB is consistent.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_image_check(const struct sr_fib* fib)
+{
+    uint32_t i, n, entry;
+    int32_t m;
+    int k;
+
+    for(i = 0; i < (uint32_t)fib->nroutes; i++)
+    {
+        if(fib->routes[i].group < 0 || fib->routes[i].group >= fib->ngroups)
+        { return -1; }
+    }
+    for(i = 0; i < (uint32_t)fib->ngroups; i++)
+    {
+        const struct sr_fib_group* group = &fib->groups[i];
+        if(group->first < 0 || group->count < 1 ||
+           group->count > fib->nmembers - group->first)
+        { return -1; }
+        /* a group may leave unused slots behind its members */
+        for(m = group->first; m < group->first + group->count; m++)
+        {
+            if(fib->members[m] < 0 || fib->members[m] >= fib->nnexthops)
+            { return -1; }
+        }
+    }
+
+    if(fib->engine == sr_fib_trie)
+    {
+        if(fib->root < -1 || fib->root >= fib->nnodes)
+        { return -1; }
+        for(i = 0; i < (uint32_t)fib->nnodes; i++)
+        {
+            const struct sr_fib_node* node = &fib->nodes[i];
+            if(node->plen > 32 || node->group < -1 ||
+               node->group >= fib->ngroups)
+            { return -1; }
+            for(k = 0; k < 2; k++)
+            {
+                if(node->child[k] == -1)
+                { continue; }
+                if(node->child[k] < 0 || node->child[k] >= fib->nnodes ||
+                   fib->nodes[node->child[k]].plen <= node->plen)
+                { return -1; }
+            }
+        }
+    }
+
+    if(fib->engine == sr_fib_dir24)
+    {
+        for(i = 0; i < FIB_TBL24_SIZE; i++)
+        {
+            entry = fib->tbl24[i];
+            if(entry & FIB_DIR24_EXT)
+            {
+                if((entry & ~FIB_DIR24_EXT) >= fib->ntbl8)
+                { return -1; }
+            }
+            else if(entry > (uint32_t)fib->ngroups)
+            { return -1; }
+        }
+        n = fib->ntbl8 * FIB_TBL8_GROUP;
+        for(i = 0; i < n; i++)
+        {
+            if(fib->tbl8[i] > (uint32_t)fib->ngroups)
+            { return -1; }
+        }
+    }
+
+    return 0;
+} /* -- sr_fib_image_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_load_image
+ * Scope:  Global
+ *
+ * Map a FIB image read-only and return a FIB whose tables point into
+ * the mapping.  Only the (small) next hop table is copied, since it
+ * carries run time interface bindings.  Every index in the tables is
+ * checked once here, a corrupt image is rejected.  Returns 0 on error.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_load_image(const char* filename)
+{
+    const struct sr_fib_image_hdr* hdr;
+    const struct sr_fib_image_nh* inh;
+    size_t routes_off, nh_off, groups_off, members_off, nodes_off;
+    size_t tbl24_off, tbl8_off;
+    struct sr_fib* fib;
+    struct stat st;
+    uint8_t* map;
+    int32_t i;
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+    {
+        perror("open");
+        return 0;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr))
+    {
+        fprintf(stderr, "FIB image %s is truncated\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    map = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+
+    hdr = (const struct sr_fib_image_hdr*)map;
+    if(hdr->magic != FIB_IMAGE_MAGIC || hdr->version != FIB_IMAGE_VERSION ||
+       hdr->node_size != sizeof(struct sr_fib_node) ||
+       hdr->engine > sr_fib_dir24 || hdr->nroutes < 0 ||
+       hdr->nnexthops < 0 || hdr->ngroups < 0 || hdr->nmembers < 0 ||
+       hdr->nnodes < 0 ||
+       sr_fib_image_layout(hdr, &routes_off, &nh_off, &groups_off,
+                           &members_off, &nodes_off, &tbl24_off,
+                           &tbl8_off) != (size_t)st.st_size)
+    {
+        fprintf(stderr, "FIB image %s is not valid for this build\n",
+                filename);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    assert(fib);
+    fib->map     = map;
+    fib->map_len = st.st_size;
+    fib->engine  = (enum sr_fib_engine)hdr->engine;
+    fib->nroutes = hdr->nroutes;
+    fib->routes  = (struct sr_fib_route*)(map + routes_off);
+    fib->ngroups = hdr->ngroups;
+    fib->groups  = (struct sr_fib_group*)(map + groups_off);
+    fib->nmembers = hdr->nmembers;
+    fib->members = (int32_t*)(map + members_off);
+    fib->root    = hdr->root;
+    fib->nnodes  = hdr->nnodes;
+    fib->nodes   = (struct sr_fib_node*)(map + nodes_off);
+    fib->ntbl8   = hdr->ntbl8;
+    if(fib->engine == sr_fib_dir24)
+    {
+        fib->tbl24 = (uint32_t*)(map + tbl24_off);
+        fib->tbl8  = (uint32_t*)(map + tbl8_off);
+    }
+
+    fib->nnexthops = hdr->nnexthops;
+    fib->nexthops  = (struct sr_nexthop*)calloc(
+            fib->nnexthops ? fib->nnexthops : 1, sizeof(struct sr_nexthop));
+    assert(fib->nexthops);
+    inh = (const struct sr_fib_image_nh*)(map + nh_off);
+    for(i = 0; i < fib->nnexthops; i++)
+    {
+        fib->nexthops[i].gw.s_addr = inh[i].gw;
+        memcpy(fib->nexthops[i].interface, inh[i].interface,
+               sr_IFACE_NAMELEN);
+        fib->nexthops[i].interface[sr_IFACE_NAMELEN - 1] = 0;
+    }
+
+    if(sr_fib_image_check(fib) != 0)
+    {
+        fprintf(stderr, "FIB image %s is corrupt\n", filename);
+        sr_fib_destroy(fib);
+        return 0;
+    }
+
+    return fib;
+} /* -- sr_fib_load_image -- */
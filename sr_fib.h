@@ -0,0 +1,199 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Compiled forwarding table (FIB) built from the routing table list.  The
+ * list in sr->routing_table stays the configuration source; sr_fib_build
+ * turns it into one of several lookup engines:
+ *
+ *   linear - the original walk over every route, kept for comparison
+ *   trie   - path-compressed binary trie, at most one node per prefix bit
+ *   dir24  - DIR-24-8 flat tables, one or two memory reads per lookup at
+ *            the cost of a 64MB first level table
+ *
+ * Several routes for the same prefix form an equal cost multipath group.
+ * The engines resolve a destination to a group and sr_fib_lookup_flow
+ * picks one member from a flow hash, so every packet of a flow takes the
+ * same path while different flows spread over all of them.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_FIB_H
+#define sr_FIB_H
+
+#ifdef _DARWIN_
+#include <sys/types.h>
+#endif
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "sr_protocol.h"
+
+struct sr_rt;
+struct sr_if;
+struct sr_adj;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_nexthop
+ *
+ * Where a lookup sends the packet.  Next hops are deduplicated per FIB and
+ * owned by it; lookups hand out const pointers into the FIB so the
+ * forwarding path never copies or frees route state.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_nexthop
+{
+    struct in_addr gw;
+    char   interface[sr_IFACE_NAMELEN];
+    struct sr_if* iface;    /* egress interface, 0 until interfaces are bound */
+    struct sr_adj* adj;     /* ethernet rewrite, 0 until interfaces are bound */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_route
+ *
+ * Compact copy of one routing table entry, in list order.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_route
+{
+    uint32_t dest;          /* network byte order */
+    uint32_t mask;          /* network byte order */
+    int32_t  group;         /* index into sr_fib->groups */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_group
+ *
+ * Next hops of one prefix: count entries of sr_fib->members starting at
+ * first, each an index into sr_fib->nexthops, in routing table order.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_group
+{
+    int32_t first;
+    int32_t count;
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_node
+ *
+ * Node of the path-compressed trie.  Nodes live in one array and refer to
+ * each other by index so the whole trie is a single allocation.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_node
+{
+    uint32_t prefix;   /* key bits, host byte order, masked to plen */
+    int32_t  child[2]; /* index of the 0/1 subtrie, -1 if none */
+    int32_t  group;    /* index into sr_fib->groups, -1 if internal only */
+    uint8_t  plen;     /* number of significant bits in prefix */
+};
+
+enum sr_fib_engine
+{
+    sr_fib_linear,
+    sr_fib_trie,
+    sr_fib_dir24
+};
+
+/* DIR-24-8: a tbl24 entry either holds group index + 1 (0 = no route)
+ * or, with FIB_DIR24_EXT set, the number of a 256 entry tbl8 group that
+ * holds group index + 1 for every value of the last address byte. */
+#define FIB_DIR24_EXT   0x80000000U
+#define FIB_TBL24_SIZE  (1 << 24)
+#define FIB_TBL8_GROUP  256
+
+struct sr_fib
+{
+    enum sr_fib_engine engine;
+    struct sr_fib_route* routes;
+    int32_t  nroutes;
+    struct sr_nexthop* nexthops;
+    int32_t  nnexthops;
+    struct sr_fib_group* groups;
+    int32_t  ngroups;
+    int32_t* members;
+    int32_t  nmembers;
+
+    /* -- trie -- */
+    struct sr_fib_node* nodes;
+    int32_t  nnodes;
+    int32_t  cap;
+    int32_t  root;
+
+    /* -- dir24 -- */
+    uint32_t* tbl24;
+    uint32_t* tbl8;
+    uint32_t  ntbl8;        /* groups in use */
+    uint32_t  tbl8_cap;     /* groups allocated */
+
+    /* -- set when the tables point into a mapped FIB image -- */
+    void*     map;
+    size_t    map_len;
+};
+
+/* ----------------------------------------------------------------------------
+ * FIB image
+ *
+ * A compiled FIB written to disk so a restarted router can mmap it
+ * instead of parsing and compiling text.  The header is followed by the
+ * route array, the next hops (struct sr_fib_image_nh), the multipath
+ * groups and their members and the engine's tables, each section
+ * starting on an 8 byte boundary.  Images are only meant to be read on
+ * the machine type that wrote them.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define FIB_IMAGE_MAGIC   0x53524642U  /* "SRFB" */
+#define FIB_IMAGE_VERSION 2
+
+struct sr_fib_image_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t engine;
+    uint32_t node_size;     /* sizeof(struct sr_fib_node) of the writer */
+    int32_t  nroutes;
+    int32_t  nnexthops;
+    int32_t  ngroups;
+    int32_t  nmembers;
+    int32_t  nnodes;
+    int32_t  root;
+    uint32_t ntbl8;
+    uint32_t reserved;
+};
+
+struct sr_fib_image_nh
+{
+    uint32_t gw;            /* network byte order */
+    char     interface[sr_IFACE_NAMELEN];
+};
+
+int sr_fib_engine_from_name(const char* name);
+const char* sr_fib_engine_name(enum sr_fib_engine engine);
+struct sr_fib* sr_fib_build(struct sr_rt* rt_list, enum sr_fib_engine engine);
+void sr_fib_destroy(struct sr_fib* fib);
+void sr_fib_bind_interfaces(struct sr_fib* fib, struct sr_if* if_list);
+size_t sr_fib_memory(const struct sr_fib* fib);
+const struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip);
+const struct sr_nexthop* sr_fib_lookup_flow(const struct sr_fib* fib,
+                                            uint32_t ip, uint32_t flow);
+int sr_fib_rpf_check(const struct sr_fib* fib, uint32_t src,
+                     const struct sr_if* iface);
+void sr_fib_lookup_burst(const struct sr_fib* fib, const uint32_t* ips,
+                         const uint32_t* flows, int n,
+                         const struct sr_nexthop** nhs);
+
+int sr_fib_is_image(const char* filename);
+int sr_fib_save_image(const struct sr_fib* fib, const char* filename);
+struct sr_fib* sr_fib_load_image(const char* filename);
+
+#endif  /* --  sr_FIB_H -- */
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -32,6 +33,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_nat.h"
 #include "sr_if.h"
 
@@ -46,16 +48,22 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
+#define DEFAULT_FIB_ENGINE sr_fib_trie
 /* below added for NAT */
 #define DEFAULT_ICMP_QUERY_TIMEOUT 60
 #define DEFAULT_TCP_EST_TIMEOUT 7440
 #define DEFAULT_TCP_TRANS_TIMEOUT 300
+#define DEFAULT_UDP_TIMEOUT 300
+#define DEFAULT_NAT_MAPPINGS 4096
+#define DEFAULT_NAT_CONNS 16384
+#define DEFAULT_NAT_SNAPSHOT_INTERVAL 60
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_nat_pool_wrap(struct sr_nat* nat, char* pool);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -78,12 +86,28 @@ int main(int argc, char **argv)
     int icmp_query_timeout = DEFAULT_ICMP_QUERY_TIMEOUT;
     int tcp_est_timeout = DEFAULT_TCP_EST_TIMEOUT;
     int tcp_trans_timeout = DEFAULT_TCP_TRANS_TIMEOUT;
+    int udp_timeout = DEFAULT_UDP_TIMEOUT;
+    unsigned long nat_mappings = DEFAULT_NAT_MAPPINGS;
+    unsigned long nat_conns = DEFAULT_NAT_CONNS;
+    char *nat_pool = 0;
+    int nat_pool_policy = nat_pool_paired;
+    unsigned int nat_port_block = 0;
+    char *nat_snapshot = 0;
+    int nat_snapshot_interval = DEFAULT_NAT_SNAPSHOT_INTERVAL;
+    int nat_restore = 0;
+    unsigned int host_max_mappings = 0;
+    unsigned int host_max_conns = 0;
+    unsigned int host_rate = 0;
+    unsigned int host_burst = 0;
+    int fib_engine = DEFAULT_FIB_ENGINE;
+    char *fib_image = 0;
+    int urpf_mode = sr_urpf_off;
 
     printf("[change!] Using %s\n", VERSION_INFO);
     printf("[1] %s\n", VERSION_INFO);
 
     /*add nI:E:R for NAT */
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:D:M:C:P:A:K:N:Q:WH:J:G:F:B:U:")) != EOF)
     {
         switch (c)
         {
@@ -127,11 +151,102 @@ int main(int argc, char **argv)
                 break;
             case 'R':
                 tcp_trans_timeout = atoi(optarg);
+                break;
+            case 'D':
+                udp_timeout = atoi(optarg);
+                break;
+            case 'M':
+                nat_mappings = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                nat_conns = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                nat_pool = optarg;
+                break;
+            case 'A':
+                if(strcmp(optarg, "paired") == 0)
+                { nat_pool_policy = nat_pool_paired; }
+                else if(strcmp(optarg, "least") == 0)
+                { nat_pool_policy = nat_pool_least_loaded; }
+                else
+                {
+                    fprintf(stderr,"Unknown NAT pool policy %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'K':
+                nat_port_block = strtoul(optarg, NULL, 10);
+                if(nat_port_block == 0 || nat_port_block % 32 != 0 ||
+                   nat_port_block > SR_NAT_SHARD_SPAN)
+                {
+                    fprintf(stderr,"NAT port block must be a multiple of 32 up to %d\n",
+                            SR_NAT_SHARD_SPAN);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'N':
+                nat_snapshot = optarg;
+                break;
+            case 'Q':
+                nat_snapshot_interval = atoi(optarg);
+                break;
+            case 'W':
+                nat_restore = 1;
+                break;
+            case 'H':
+                host_max_mappings = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                host_max_conns = strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                {
+                    char *end;
+                    host_rate = strtoul(optarg, &end, 10);
+                    host_burst = (*end == ',') ? strtoul(end + 1, NULL, 10) :
+                                                 host_rate * 4;
+                    if(host_rate == 0 || host_burst == 0)
+                    {
+                        fprintf(stderr,"NAT mapping rate must be rate[,burst] above 0\n");
+                        usage(argv[0]);
+                        exit(1);
+                    }
+                }
+                break;
+            case 'F':
+                fib_engine = sr_fib_engine_from_name(optarg);
+                if(fib_engine < 0)
+                {
+                    fprintf(stderr,"Unknown FIB engine %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                fib_image = optarg;
+                break;
+            case 'U':
+                if(strcmp(optarg, "loose") == 0)
+                { urpf_mode = sr_urpf_loose; }
+                else if(strcmp(optarg, "strict") == 0)
+                { urpf_mode = sr_urpf_strict; }
+                else
+                {
+                    fprintf(stderr,"Unknown uRPF mode %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fib_engine = fib_engine;
+    sr.urpf_mode = urpf_mode;
    
 
     /* -- set up routing table from file -- */
@@ -142,6 +257,25 @@ int main(int argc, char **argv)
     else
         strncpy(sr.template, template, 30);
 
+    /* -- compile only: write the FIB image for a later -r and quit -- */
+    if(fib_image)
+    {
+        if(template != NULL || sr.fib == NULL)
+        {
+            fprintf(stderr,"No routing table to compile into %s\n",
+                    fib_image);
+            exit(1);
+        }
+        if(sr_fib_save_image(sr.fib, fib_image) != 0)
+        {
+            fprintf(stderr,"Error writing FIB image %s\n", fib_image);
+            exit(1);
+        }
+        printf("Wrote %s FIB image %s\n",
+               sr_fib_engine_name(sr.fib->engine), fib_image);
+        exit(0);
+    }
+
     sr.topo_id = topo;
     strncpy(sr.host,host,32);
 
@@ -188,12 +322,35 @@ int main(int argc, char **argv)
     sr_init(&sr);
 
     /* added for NAT */
-    sr.nat_on = nat_on;
     sr.nat = (struct sr_nat *)malloc(sizeof(struct sr_nat));
     sr_nat_init(sr.nat);
     sr.nat->icmp_query_timeout = icmp_query_timeout;
     sr.nat->tcp_est_timeout = tcp_est_timeout;
     sr.nat->tcp_trans_timeout = tcp_trans_timeout;
+    sr.nat->udp_timeout = udp_timeout;
+    sr.nat->pool_policy = nat_pool_policy;
+    sr.nat->port_block = nat_port_block;
+    sr.nat->snapshot_file = nat_snapshot;
+    sr.nat->snapshot_interval = nat_snapshot_interval;
+    sr.nat->host_max_mappings = host_max_mappings;
+    sr.nat->host_max_conns = host_max_conns;
+    sr.nat->host_rate = host_rate;
+    sr.nat->host_burst = host_burst;
+    sr.nat_restore = nat_restore;
+    if (nat_restore && !nat_snapshot)
+    {
+        fprintf(stderr,"-W needs a NAT snapshot file (-N)\n");
+        exit(1);
+    }
+    if (nat_pool)
+    { sr_nat_pool_wrap(sr.nat, nat_pool); }
+    if (nat_on && sr_nat_reserve(sr.nat, nat_mappings, nat_conns) != 0)
+    {
+        fprintf(stderr,"Unable to preallocate NAT tables\n");
+        exit(1);
+    }
+    /* last: the signal thread looks at the NAT once this is set */
+    sr.nat_on = nat_on;
     /* NAT */
 
     /* -- whizbang main loop ;-) */
@@ -215,7 +372,18 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-F linear|trie|dir24] \n");
+    printf("           [-B write FIB image of routing table and exit] \n");
+    printf("           [-U loose|strict reverse path check] \n");
+    printf("           [-M NAT mappings] [-C NAT connections] to preallocate \n");
+    printf("           [-D UDP idle timeout] \n");
+    printf("           [-P NAT external addresses a.b.c.d,...] \n");
+    printf("           [-A paired|least NAT address selection] \n");
+    printf("           [-K ports per internal host block (CGNAT mode)] \n");
+    printf("           [-N NAT snapshot file] [-Q seconds between snapshots] \n");
+    printf("           [-W restore the NAT snapshot at startup] \n");
+    printf("           [-H NAT mappings] [-J NAT connections] per internal host \n");
+    printf("           [-G new NAT mappings a second per host[,burst]] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -285,66 +453,23 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr_epoch_init(&(sr->fib_epoch));
+    sr->rtable_file = 0;
+    sr->urpf_mode = sr_urpf_off;
+    sr->urpf_drops = 0;
     sr->logfile = 0;
+    sr->nat = 0;
+    sr->nat_on = 0;
 } /* -- sr_init_instance -- */
 
-/*-----------------------------------------------------------------------------
- * Method: sr_verify_routing_table()
- * Scope: Global
- *
- * make sure the routing table is consistent with the interface list by
- * verifying that all interfaces used in the routing table actually exist
- * in the hardware.
- *
- * RETURN VALUES:
- *
- *  0 on success
- *  something other than zero on error
- *
- *---------------------------------------------------------------------------*/
-
-int sr_verify_routing_table(struct sr_instance* sr)
-{
-    struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
-    int ret = 0;
-
-    /* -- REQUIRES --*/
-    assert(sr);
-
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
-    {
-        return 999; /* doh! */
-    }
-
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
-    {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
-
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
-
-    return ret;
-} /* -- sr_verify_routing_table -- */
-
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     if(sr_load_rt(sr, rtable) != 0) {
         fprintf(stderr,"Error setting up routing table from file %s\n",
                 rtable);
         exit(1);
     }
+    sr->rtable_file = rtable;
 
 
     printf("Loading routing table\n");
@@ -353,3 +478,25 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     printf("---------------------------------------------\n");
 }
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_nat_pool_wrap(..)
+ * Scope: local
+ *
+ * Adds the comma separated addresses of pool to the NAT's external pool.
+ *---------------------------------------------------------------------------*/
+
+static void sr_nat_pool_wrap(struct sr_nat* nat, char* pool)
+{
+    char* tok;
+    struct in_addr addr;
+
+    for(tok = strtok(pool, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        if(inet_aton(tok, &addr) == 0 ||
+           sr_nat_add_address(nat, addr.s_addr) != 0)
+        {
+            fprintf(stderr,"Bad NAT external address %s\n", tok);
+            exit(1);
+        }
+    }
+} /* -- sr_nat_pool_wrap -- */
@@ -3,6 +3,9 @@
 #include <assert.h>
 #include "sr_nat.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,10 +20,14 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   
   
   assert(nat);
+  int i;
+  int success = 0;
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    success |= pthread_mutex_init(&(nat->shards[i].lock), &(nat->attr));
+  }
 
   /* Initialize timeout thread */
 
@@ -30,342 +37,1498 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
   pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
-  nat->mappings = NULL;
-  nat->max_port = 1024;
+  memset(nat->addrs, 0, sizeof(nat->addrs));
+  nat->naddrs = 0;
+  nat->pool_policy = nat_pool_paired;
+  nat->port_block = 0;
+  nat->host_max_mappings = 0;
+  nat->host_max_conns = 0;
+  nat->host_rate = 0;
+  nat->host_burst = 0;
+  nat->snapshot_file = NULL;
+  nat->snapshot_interval = 0;
+  nat->snapshot_next = 0;
+  pthread_mutex_init(&(nat->snapshot_lock), NULL);
+  sr_epoch_init(&(nat->epoch));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    sh->nat = nat;
+    sh->port_lo = SR_NAT_PORT_MIN + i * SR_NAT_SHARD_SPAN;
+    sh->port_hi = (i == SR_NAT_SHARDS - 1) ? SR_NAT_PORTS : sh->port_lo + SR_NAT_SHARD_SPAN;
+    sh->mappings = NULL;
+    sh->nmappings = 0;
+    sh->int_hash_size = SR_NAT_HASH_INIT;
+    sh->int_hash = (struct sr_nat_mapping **)calloc(sh->int_hash_size,
+      sizeof(struct sr_nat_mapping *));
+    assert(sh->int_hash);
+    sh->nconns = 0;
+    sh->conn_hash_size = SR_NAT_HASH_INIT;
+    sh->conn_hash = (struct sr_nat_connection **)calloc(sh->conn_hash_size,
+      sizeof(struct sr_nat_connection *));
+    assert(sh->conn_hash);
+    sh->nblocks = 0;
+    sh->block_hash = (struct sr_nat_block **)calloc(SR_NAT_BLOCK_HASH,
+      sizeof(struct sr_nat_block *));
+    assert(sh->block_hash);
+    sr_slab_init(&(sh->block_pool), sizeof(struct sr_nat_block), SR_NAT_SLAB_GROW);
+    sh->nhosts = 0;
+    sh->quota_drops = 0;
+    sh->rate_drops = 0;
+    sh->host_hash = (struct sr_nat_host **)calloc(SR_NAT_HOST_HASH,
+      sizeof(struct sr_nat_host *));
+    assert(sh->host_hash);
+    sr_slab_init(&(sh->host_pool), sizeof(struct sr_nat_host), SR_NAT_SLAB_GROW);
+    memset(sh->wheel, 0, sizeof(sh->wheel));
+    sh->retired = NULL;
+    sr_slab_init(&(sh->map_pool), sizeof(struct sr_nat_mapping), SR_NAT_SLAB_GROW);
+    sr_slab_init(&(sh->conn_pool), sizeof(struct sr_nat_connection), SR_NAT_SLAB_GROW);
+    sh->wheel_now = time(NULL);
+  }
     
   return success;
 }
 
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
-  pthread_mutex_lock(&(nat->lock)); 
+  int i;
+  int ret = 0;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+  pthread_kill(nat->thread, SIGKILL);
   /* free nat memory here */
-  struct sr_nat_mapping* current = nat->mappings;
-  while(current != NULL){
-    struct sr_nat_mapping* next = current->next;
-    /* free sr_nat_mapping*/
-    free(current);
-    current = next;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    sr_slab_destroy(&(sh->map_pool));
+    sr_slab_destroy(&(sh->conn_pool));
+    free(sh->int_hash);
+    free(sh->conn_hash);
+    sr_slab_destroy(&(sh->block_pool));
+    free(sh->block_hash);
+    sr_slab_destroy(&(sh->host_pool));
+    free(sh->host_hash);
+    pthread_mutex_unlock(&(sh->lock));
+    ret |= pthread_mutex_destroy(&(sh->lock));
+  }
+  for (i = 0; i < nat->naddrs; i++) {
+    free(nat->addrs[i]);
   }
+  ret |= pthread_mutexattr_destroy(&(nat->attr));
   free(nat);
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) && pthread_mutexattr_destroy(&(nat->attr));
+  return ret;
+
+}
+
+
+/* Add ip to the external address pool, keeping it sorted. */
+int sr_nat_add_address(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_addr *addr;
+  unsigned int i, t, s;
+
+  if (nat->naddrs == SR_NAT_ADDRS_MAX || sr_nat_is_external(nat, ip)) {
+    return -1;
+  }
+  addr = (struct sr_nat_addr *)calloc(1, sizeof(struct sr_nat_addr));
+  if (!addr) {
+    return -1;
+  }
+  addr->ip = ip;
+  for (s = 0; s < SR_NAT_SHARDS; s++) {
+    for (t = 0; t < SR_NAT_NTYPES; t++) {
+      addr->port_cursor[s][t] = nat->shards[s].port_lo / 32;
+    }
+  }
+  for (i = nat->naddrs; i > 0 && ntohl(nat->addrs[i - 1]->ip) > ntohl(ip); i--) {
+    nat->addrs[i] = nat->addrs[i - 1];
+  }
+  nat->addrs[i] = addr;
+  nat->naddrs++;
+  return 0;
+}
+
+/* Pool entry of external address ip, NULL if it is not one. */
+static struct sr_nat_addr *sr_nat_addr_find(struct sr_nat *nat, uint32_t ip) {
+  unsigned int lo = 0, hi = nat->naddrs;
+  uint32_t key = ntohl(ip);
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    uint32_t cur = ntohl(nat->addrs[mid]->ip);
+    if (cur == key) {
+      return nat->addrs[mid];
+    }
+    if (cur < key) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+int sr_nat_is_external(struct sr_nat *nat, uint32_t ip) {
+  return sr_nat_addr_find(nat, ip) != NULL;
+}
+
+/* Hash of internal host ip_int. Taken in host byte order so hosts that
+   only differ in the last octet still spread over the bits used below. */
+static uint32_t sr_nat_host_hash(uint32_t ip_int) {
+  return ntohl(ip_int) * 2654435761U;
+}
+
+/* Shard holding the mappings of internal host ip_int. */
+static struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat, uint32_t ip_int) {
+  uint32_t h = sr_nat_host_hash(ip_int);
+  return &(nat->shards[(h >> 16) & (SR_NAT_SHARDS - 1)]);
+}
+
+/* Shard owning external port aux_ext, NULL for ports never handed out. */
+static struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat, uint16_t aux_ext) {
+  unsigned int i;
+
+  if (aux_ext < SR_NAT_PORT_MIN) {
+    return NULL;
+  }
+  i = (aux_ext - SR_NAT_PORT_MIN) / SR_NAT_SHARD_SPAN;
+  if (i >= SR_NAT_SHARDS) {
+    i = SR_NAT_SHARDS - 1;
+  }
+  return &(nat->shards[i]);
+}
+
+
+/* External address for a new mapping of ip_int, by the pool policy.
+   NULL while the pool is empty. Caller holds the lock. */
+static struct sr_nat_addr *sr_nat_addr_pick(struct sr_nat_shard *sh,
+  uint32_t ip_int, sr_nat_mapping_type type) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int s = sh - nat->shards;
+  unsigned int i, best;
+
+  if (nat->naddrs == 0) {
+    return NULL;
+  }
+  if (nat->pool_policy == nat_pool_paired) {
+    /* other hash bits than sr_nat_shard_int, so a shard's hosts still
+       spread over the whole pool */
+    return nat->addrs[(sr_nat_host_hash(ip_int) >> 20) % nat->naddrs];
+  }
+  best = 0;
+  for (i = 1; i < nat->naddrs; i++) {
+    if (nat->addrs[i]->used[s][type] < nat->addrs[best]->used[s][type]) {
+      best = i;
+    }
+  }
+  return nat->addrs[best];
+}
+
+/* Take the first free port of bitmap words [lo, hi) at or after word
+   *cursor, wrapping back to lo. Returns -1 when all are in use. */
+static int sr_nat_port_scan(uint32_t *bits, unsigned int *cursor,
+  unsigned int lo, unsigned int hi) {
+  unsigned int w = *cursor;
+  unsigned int tries;
+
+  for (tries = 0; tries < hi - lo; tries++) {
+    if (bits[w] != 0xffffffffU) {
+      int bit = __builtin_ctz(~bits[w]);
+      bits[w] |= 1U << bit;
+      *cursor = w;
+      return w * 32 + bit;
+    }
+    if (++w == hi) {
+      w = lo;
+    }
+  }
+  return -1;
+}
+
+/* Take a free external port of the shard's slice of addr. Returns -1
+   when all are in use. Caller holds the lock. */
+static int sr_nat_port_alloc(struct sr_nat_shard *sh, struct sr_nat_addr *addr,
+  sr_nat_mapping_type type) {
+  unsigned int s = sh - sh->nat->shards;
+  int port = sr_nat_port_scan(addr->port_map[type], &(addr->port_cursor[s][type]),
+    sh->port_lo / 32, sh->port_hi / 32);
+  if (port >= 0) {
+    addr->used[s][type]++;
+  }
+  return port;
+}
+
+/* Give port of addr back to the allocator. Caller holds the lock. */
+static void sr_nat_port_free(struct sr_nat_shard *sh, struct sr_nat_addr *addr,
+  sr_nat_mapping_type type, uint16_t port) {
+  addr->port_map[type][port >> 5] &= ~(1U << (port & 31));
+  addr->used[sh - sh->nat->shards][type]--;
+}
+
+/* Bucket of (type, ip_int, aux_int) in the internal index. */
+static unsigned int sr_nat_int_bucket(struct sr_nat_shard *sh, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type) {
+  uint32_t h = ip_int * 2654435761U;
+  h ^= ((uint32_t)aux_int << 8 | type) * 0x9e3779b9U;
+  h ^= h >> 15;
+  return h & (sh->int_hash_size - 1);
+}
+
+/* Double the internal index once it holds more mappings than buckets. */
+static void sr_nat_int_grow(struct sr_nat_shard *sh) {
+  unsigned int old_size = sh->int_hash_size;
+  struct sr_nat_mapping **old_hash = sh->int_hash;
+  unsigned int i;
+
+  sh->int_hash_size = old_size * 2;
+  sh->int_hash = (struct sr_nat_mapping **)calloc(sh->int_hash_size,
+    sizeof(struct sr_nat_mapping *));
+  assert(sh->int_hash);
+
+  for (i = 0; i < old_size; i++) {
+    struct sr_nat_mapping *map = old_hash[i];
+    while (map) {
+      struct sr_nat_mapping *next = map->int_next;
+      unsigned int b = sr_nat_int_bucket(sh, map->ip_int, map->aux_int, map->type);
+      map->int_next = sh->int_hash[b];
+      sh->int_hash[b] = map;
+      map = next;
+    }
+  }
+  free(old_hash);
+}
+
+/* Add map to the internal index. Caller holds the lock. */
+static void sr_nat_int_link(struct sr_nat_shard *sh, struct sr_nat_mapping *map) {
+  unsigned int b;
+
+  if (++sh->nmappings > sh->int_hash_size) {
+    sr_nat_int_grow(sh);
+  }
+  b = sr_nat_int_bucket(sh, map->ip_int, map->aux_int, map->type);
+  map->int_next = sh->int_hash[b];
+  sh->int_hash[b] = map;
+}
+
+/* Remove map from the internal index. Caller holds the lock. */
+static void sr_nat_int_unlink(struct sr_nat_shard *sh, struct sr_nat_mapping *map) {
+  struct sr_nat_mapping **link;
+
+  link = &(sh->int_hash[sr_nat_int_bucket(sh, map->ip_int, map->aux_int, map->type)]);
+  while (*link && *link != map) {
+    link = &((*link)->int_next);
+  }
+  if (*link) {
+    *link = map->int_next;
+    sh->nmappings--;
+  }
+}
+
+/* Put t on the wheel slot for t->expires. Caller holds the lock. */
+static void sr_nat_timer_add(struct sr_nat_shard *sh, struct sr_nat_timer *t) {
+  struct sr_nat_timer **slot;
+  time_t when = t->expires;
+
+  if (when < sh->wheel_now) {
+    when = sh->wheel_now;
+  }
+  if (when - sh->wheel_now < SR_NAT_WHEEL_SIZE) {
+    slot = &(sh->wheel[0][when & SR_NAT_WHEEL_MASK]);
+  }
+  else {
+    /* beyond the upper level: park in its last slot, the cascade puts it
+       back further out until it is in range */
+    if (when - sh->wheel_now >= SR_NAT_WHEEL_SIZE * SR_NAT_WHEEL_SIZE) {
+      when = sh->wheel_now + SR_NAT_WHEEL_SIZE * SR_NAT_WHEEL_SIZE - 1;
+    }
+    slot = &(sh->wheel[1][(when >> SR_NAT_WHEEL_BITS) & SR_NAT_WHEEL_MASK]);
+  }
+  t->next = *slot;
+  if (t->next) {
+    t->next->pprev = &(t->next);
+  }
+  t->pprev = slot;
+  *slot = t;
+}
+
+/* Take t off the wheel if it is armed. Caller holds the lock. */
+static void sr_nat_timer_del(struct sr_nat_timer *t) {
+  if (t->pprev) {
+    *(t->pprev) = t->next;
+    if (t->next) {
+      t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    t->next = NULL;
+  }
+}
+
+/* (Re)arm t to fire at expires. Caller holds the lock. */
+static void sr_nat_timer_arm(struct sr_nat_shard *sh, struct sr_nat_timer *t,
+  time_t expires) {
+  sr_nat_timer_del(t);
+  t->expires = expires;
+  sr_nat_timer_add(sh, t);
+}
+
+/* When conn times out given its state and last activity. */
+static time_t sr_nat_conn_expires(struct sr_nat_shard *sh, struct sr_nat_connection *conn) {
+  switch (conn->state) {
+    case SYN_SENT:
+    case SYN_RCVD:
+    case CLOSING:
+    case LAST_ACK:
+      return conn->last_updated + sh->nat->tcp_trans_timeout;
+    default:
+      return conn->last_updated + sh->nat->tcp_est_timeout;
+  }
+}
+
+/* Re-arm conn after activity or a state change. Caller holds the lock. */
+static void sr_nat_conn_touch(struct sr_nat_shard *sh, struct sr_nat_connection *conn) {
+  sr_nat_timer_arm(sh, &(conn->timer), sr_nat_conn_expires(sh, conn));
+}
+
+/* Bucket of the tcp 5-tuple (ip_int, aux_int, outhost_ip, outhost_port). */
+static unsigned int sr_nat_conn_bucket(struct sr_nat_shard *sh, uint32_t ip_int,
+  uint16_t aux_int, uint32_t outhost_ip, uint32_t outhost_port) {
+  uint32_t h = ip_int * 2654435761U;
+  h ^= outhost_ip * 0x85ebca6bU;
+  h ^= ((uint32_t)aux_int << 16 | (outhost_port & 0xffff)) * 0x9e3779b9U;
+  h ^= h >> 15;
+  return h & (sh->conn_hash_size - 1);
+}
+
+/* Double the connection index once it holds more entries than buckets. */
+static void sr_nat_conn_grow(struct sr_nat_shard *sh) {
+  unsigned int old_size = sh->conn_hash_size;
+  struct sr_nat_connection **old_hash = sh->conn_hash;
+  unsigned int i;
+
+  sh->conn_hash_size = old_size * 2;
+  sh->conn_hash = (struct sr_nat_connection **)calloc(sh->conn_hash_size,
+    sizeof(struct sr_nat_connection *));
+  assert(sh->conn_hash);
+
+  for (i = 0; i < old_size; i++) {
+    struct sr_nat_connection *conn = old_hash[i];
+    while (conn) {
+      struct sr_nat_connection *next = conn->hnext;
+      unsigned int b = sr_nat_conn_bucket(sh, conn->mapping->ip_int,
+        conn->mapping->aux_int, conn->outhost_ip, conn->outhost_port);
+      conn->hnext = sh->conn_hash[b];
+      sh->conn_hash[b] = conn;
+      conn = next;
+    }
+  }
+  free(old_hash);
+}
+
+/* Find the connection of map to (outhost_ip, outhost_port). Caller holds the lock. */
+static struct sr_nat_connection *sr_nat_conn_find(struct sr_nat_shard *sh,
+  struct sr_nat_mapping *map, uint32_t outhost_ip, uint32_t outhost_port) {
+  struct sr_nat_connection *conn;
+
+  conn = sh->conn_hash[sr_nat_conn_bucket(sh, map->ip_int, map->aux_int,
+    outhost_ip, outhost_port)];
+  while (conn) {
+    if (conn->mapping == map && conn->outhost_ip == outhost_ip &&
+        conn->outhost_port == outhost_port) {
+      return conn;
+    }
+    conn = conn->hnext;
+  }
+  return NULL;
+}
+
+/* Nonzero if any per host limit is set. */
+static int sr_nat_host_limits(struct sr_nat *nat) {
+  return nat->host_max_mappings || nat->host_max_conns || nat->host_rate;
+}
+
+/* Limits record of internal host ip_int, created with a full bucket if
+   it has none. NULL when out of memory. Caller holds the lock. */
+static struct sr_nat_host *sr_nat_host_get(struct sr_nat_shard *sh,
+  uint32_t ip_int, time_t now) {
+  unsigned int b = (sr_nat_host_hash(ip_int) >> 20) & (SR_NAT_HOST_HASH - 1);
+  struct sr_nat_host *host;
+
+  for (host = sh->host_hash[b]; host; host = host->next) {
+    if (host->ip_int == ip_int) {
+      return host;
+    }
+  }
+  host = (struct sr_nat_host *)sr_slab_alloc(&(sh->host_pool));
+  if (!host) {
+    return NULL;
+  }
+  memset(host, 0, sizeof(*host));
+  host->ip_int = ip_int;
+  host->tokens = sh->nat->host_burst;
+  host->refilled = now;
+  host->timer.pprev = NULL;
+  host->timer.kind = nat_timer_host;
+  host->timer.owner = host;
+  host->next = sh->host_hash[b];
+  sh->host_hash[b] = host;
+  sh->nhosts++;
+  return host;
+}
+
+/* Add the tokens host earned since it was last refilled, up to the
+   burst. Caller holds the lock. */
+static void sr_nat_host_refill(struct sr_nat *nat, struct sr_nat_host *host,
+  time_t now) {
+  if (now > host->refilled) {
+    unsigned long add = (unsigned long)(now - host->refilled) * nat->host_rate;
+    host->tokens = (host->tokens + add > nat->host_burst) ?
+      nat->host_burst : host->tokens + add;
+    host->refilled = now;
+  }
+}
+
+/* Called when host has no mapping or connection left: retire its
+   record if the bucket is full, so a new record would be no different,
+   or else arm its timer for when the bucket will be full. Caller holds
+   the lock. */
+static void sr_nat_host_idle(struct sr_nat_shard *sh, struct sr_nat_host *host,
+  time_t now) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int b = (sr_nat_host_hash(host->ip_int) >> 20) & (SR_NAT_HOST_HASH - 1);
+  struct sr_nat_host **pp;
+
+  if (host->nmappings || host->nconns) {
+    return;
+  }
+  if (nat->host_rate) {
+    sr_nat_host_refill(nat, host, now);
+    if (host->tokens < nat->host_burst) {
+      sr_nat_timer_arm(sh, &(host->timer), now +
+        (nat->host_burst - host->tokens + nat->host_rate - 1) / nat->host_rate);
+      return;
+    }
+  }
+  sr_nat_timer_del(&(host->timer));
+  for (pp = &(sh->host_hash[b]); *pp != host; pp = &((*pp)->next))
+    ;
+  *pp = host->next;
+  sh->nhosts--;
+  sr_slab_free(&(sh->host_pool), host);
+}
+
+/* Count a refusal of host; logged rate limited so a host hammering its
+   limit shows up without flooding the log. Caller holds the lock. */
+static void sr_nat_host_refuse(struct sr_nat_shard *sh, struct sr_nat_host *host,
+  int by_rate) {
+  char buf[INET_ADDRSTRLEN];
+  unsigned long drops;
+
+  if (by_rate) {
+    drops = ++host->rate_drops;
+    sh->rate_drops++;
+  }
+  else {
+    drops = ++host->quota_drops;
+    sh->quota_drops++;
+  }
+  if ((drops & 0x3ff) == 1) {
+    inet_ntop(AF_INET, &(host->ip_int), buf, sizeof(buf));
+    fprintf(stderr, "** NAT: host %s throttled, %lu over quota, %lu over rate\n",
+      buf, host->quota_drops, host->rate_drops);
+  }
+}
+
+/* Whether host may create another mapping now. The caller takes the
+   token once the mapping exists. Caller holds the lock. */
+static int sr_nat_host_admit(struct sr_nat_shard *sh, struct sr_nat_host *host,
+  time_t now) {
+  struct sr_nat *nat = sh->nat;
+
+  if (nat->host_max_mappings && host->nmappings >= nat->host_max_mappings) {
+    sr_nat_host_refuse(sh, host, 0);
+    return 0;
+  }
+  if (nat->host_rate) {
+    sr_nat_host_refill(nat, host, now);
+    if (host->tokens == 0) {
+      sr_nat_host_refuse(sh, host, 1);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Start tracking a connection of map, or restart it on a retransmitted SYN.
+   Returns NULL when out of memory or, if capped, when the host is at its
+   connection cap. Caller holds the lock. */
+static struct sr_nat_connection *sr_nat_conn_new(struct sr_nat_shard *sh,
+  struct sr_nat_mapping *map, uint32_t outhost_ip, uint32_t outhost_port,
+  connection_state state, time_t now, int capped) {
+  struct sr_nat_connection *conn;
+  unsigned int b;
+
+  conn = sr_nat_conn_find(sh, map, outhost_ip, outhost_port);
+  if (conn) {
+    conn->state = state;
+    conn->last_updated = now;
+    sr_nat_conn_touch(sh, conn);
+    return conn;
+  }
+
+  if (capped && map->host && sh->nat->host_max_conns &&
+      map->host->nconns >= sh->nat->host_max_conns) {
+    sr_nat_host_refuse(sh, map->host, 0);
+    return NULL;
+  }
+  conn = (struct sr_nat_connection *)sr_slab_alloc(&(sh->conn_pool));
+  if (!conn) {
+    return NULL;
+  }
+  conn->initialized = now;
+  conn->outhost_ip = outhost_ip;
+  conn->outhost_port = outhost_port;
+  conn->state = state;
+  conn->last_updated = now;
+  conn->mapping = map;
+  conn->prev = NULL;
+  conn->next = map->conns;
+  if (conn->next) {
+    conn->next->prev = conn;
+  }
+  map->conns = conn;
+  conn->timer.pprev = NULL;
+  conn->timer.kind = nat_timer_conn;
+  conn->timer.owner = conn;
+  sr_nat_conn_touch(sh, conn);
+
+  if (++sh->nconns > sh->conn_hash_size) {
+    sr_nat_conn_grow(sh);
+  }
+  b = sr_nat_conn_bucket(sh, map->ip_int, map->aux_int, outhost_ip, outhost_port);
+  conn->hnext = sh->conn_hash[b];
+  sh->conn_hash[b] = conn;
+  if (map->host) {
+    map->host->nconns++;
+  }
+  return conn;
+}
+
+/* Remove conn from the connection index. Caller holds the lock. */
+static void sr_nat_conn_unlink(struct sr_nat_shard *sh, struct sr_nat_connection *conn) {
+  struct sr_nat_connection **link;
+
+  link = &(sh->conn_hash[sr_nat_conn_bucket(sh, conn->mapping->ip_int,
+    conn->mapping->aux_int, conn->outhost_ip, conn->outhost_port)]);
+  while (*link && *link != conn) {
+    link = &((*link)->hnext);
+  }
+  if (*link) {
+    *link = conn->hnext;
+    sh->nconns--;
+  }
+}
+
+
+/* Port block of internal host ip_int, NULL if it has none. Caller
+   holds the lock. */
+static struct sr_nat_block *sr_nat_block_find(struct sr_nat_shard *sh,
+  uint32_t ip_int) {
+  unsigned int b = (sr_nat_host_hash(ip_int) >> 20) & (SR_NAT_BLOCK_HASH - 1);
+  struct sr_nat_block *block;
+
+  for (block = sh->block_hash[b]; block; block = block->next) {
+    if (block->ip_int == ip_int) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+/* Assign the free block of addr starting at port word w to ip_int.
+   Caller holds the lock. */
+static struct sr_nat_block *sr_nat_block_take(struct sr_nat_shard *sh,
+  struct sr_nat_addr *addr, uint32_t ip_int, unsigned int w) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int b = (sr_nat_host_hash(ip_int) >> 20) & (SR_NAT_BLOCK_HASH - 1);
+  unsigned int t;
+  struct sr_nat_block *block;
+
+  block = (struct sr_nat_block *)sr_slab_alloc(&(sh->block_pool));
+  if (!block) {
+    return NULL;
+  }
+  addr->block_map[w >> 5] |= 1U << (w & 31);
+  block->ip_int = ip_int;
+  block->addr = addr;
+  block->first = w * 32;
+  block->nmappings = 0;
+  for (t = 0; t < SR_NAT_NTYPES; t++) {
+    block->cursor[t] = w;
+  }
+  block->next = sh->block_hash[b];
+  sh->block_hash[b] = block;
+  sh->nblocks++;
+  printf("Assigned port block: ip_int = %d, ip_ext = %d, ports %d-%d\n", ip_int,
+    addr->ip, block->first, block->first + nat->port_block - 1);
+  return block;
+}
+
+/* Port block of internal host ip_int, assigned from the shard's slice
+   of an address picked by the pool policy if the host has none, or of
+   the next address with a free block. NULL when no address has one
+   left. Caller holds the lock. */
+static struct sr_nat_block *sr_nat_block_get(struct sr_nat_shard *sh,
+  uint32_t ip_int, sr_nat_mapping_type type) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int s = sh - nat->shards;
+  unsigned int step = nat->port_block / 32;
+  unsigned int nb = (sh->port_hi - sh->port_lo) / nat->port_block;
+  unsigned int a, first, i, j, w;
+  struct sr_nat_block *block;
+  struct sr_nat_addr *addr;
+
+  block = sr_nat_block_find(sh, ip_int);
+  if (block) {
+    return block;
+  }
+
+  addr = sr_nat_addr_pick(sh, ip_int, type);
+  if (!addr) {
+    return NULL;
+  }
+  /* the policy's address first, then the rest of the pool in order */
+  for (first = 0; nat->addrs[first] != addr; first++)
+    ;
+  for (a = 0; a < nat->naddrs; a++) {
+    addr = nat->addrs[(first + a) % nat->naddrs];
+    for (i = 0; i < nb; i++) {
+      j = (addr->block_cursor[s] + i) % nb;
+      w = sh->port_lo / 32 + j * step;
+      if (!(addr->block_map[w >> 5] & (1U << (w & 31)))) {
+        break;
+      }
+    }
+    if (i < nb) {
+      block = sr_nat_block_take(sh, addr, ip_int, w);
+      if (block) {
+        addr->block_cursor[s] = (j + 1) % nb;
+      }
+      return block;
+    }
+  }
+  fprintf(stderr, "** NAT: no free port block left for a new host\n");
+  return NULL;
+}
+
+/* Give block back once its host has no mapping left. Caller holds the
+   lock. */
+static void sr_nat_block_put(struct sr_nat_shard *sh, struct sr_nat_block *block) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int b = (sr_nat_host_hash(block->ip_int) >> 20) & (SR_NAT_BLOCK_HASH - 1);
+  unsigned int w = block->first / 32;
+  struct sr_nat_block **pp;
+
+  if (block->nmappings) {
+    return;
+  }
+  for (pp = &(sh->block_hash[b]); *pp != block; pp = &((*pp)->next))
+    ;
+  *pp = block->next;
+  sh->nblocks--;
+  block->addr->block_map[w >> 5] &= ~(1U << (w & 31));
+  printf("Released port block: ip_int = %d, ip_ext = %d, ports %d-%d\n", block->ip_int,
+    block->addr->ip, block->first, block->first + nat->port_block - 1);
+  sr_slab_free(&(sh->block_pool), block);
+}
+
+/* Take a free external port of block. Returns -1 when all are in use.
+   Caller holds the lock. */
+static int sr_nat_block_port_alloc(struct sr_nat_shard *sh, struct sr_nat_block *block,
+  sr_nat_mapping_type type) {
+  int port = sr_nat_port_scan(block->addr->port_map[type], &(block->cursor[type]),
+    block->first / 32, (block->first + sh->nat->port_block) / 32);
+  if (port >= 0) {
+    block->addr->used[sh - sh->nat->shards][type]++;
+  }
+  return port;
+}
+
+/* Unlink map from every index and retire it. Caller holds the lock. */
+static void sr_nat_free_mapping(struct sr_nat_shard *sh, struct sr_nat_mapping *map) {
+  sr_nat_timer_del(&(map->timer));
+  sr_nat_int_unlink(sh, map);
+  struct sr_nat_addr *addr = sr_nat_addr_find(sh->nat, map->ip_ext);
+  addr->ext_ports[map->type][map->aux_ext] = NULL;
+  sr_nat_port_free(sh, addr, map->type, map->aux_ext);
+  if (map->block) {
+    map->block->nmappings--;
+    sr_nat_block_put(sh, map->block);
+  }
+  if (map->host) {
+    map->host->nmappings--;
+    sr_nat_host_idle(sh, map->host, time(NULL));
+  }
+  if (map->prev) {
+    map->prev->next = map->next;
+  }
+  else {
+    sh->mappings = map->next;
+  }
+  if (map->next) {
+    map->next->prev = map->prev;
+  }
+  /* readers in the nat epoch may still hold it, the timeout thread hands
+     it back to the pool after a grace period */
+  map->next = sh->retired;
+  sh->retired = map;
+}
+
+/* Free conn, and its mapping with it if it was the last connection.
+   Caller holds the lock. */
+static void sr_nat_free_conn(struct sr_nat_shard *sh, struct sr_nat_connection *conn) {
+  struct sr_nat_mapping *map = conn->mapping;
 
+  sr_nat_timer_del(&(conn->timer));
+  sr_nat_conn_unlink(sh, conn);
+  if (map->host) {
+    map->host->nconns--;
+  }
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  }
+  else {
+    map->conns = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  sr_slab_free(&(sh->conn_pool), conn);
+  if (!map->conns) {
+    sr_nat_free_mapping(sh, map);
+  }
 }
 
+/* Idle timeout of a mapping that expires by itself (icmp, udp). */
+static time_t sr_nat_idle_timeout(struct sr_nat *nat, sr_nat_mapping_type type) {
+  return (type == nat_mapping_udp) ? nat->udp_timeout : nat->icmp_query_timeout;
+}
+
+/* A timer came due: expire its owner. Caller holds the lock. */
+static void sr_nat_timer_fire(struct sr_nat_shard *sh, struct sr_nat_timer *t, time_t now) {
+  if (t->kind == nat_timer_host) {
+    /* the bucket is full now, unless the host got busy again */
+    sr_nat_host_idle(sh, (struct sr_nat_host *)t->owner, now);
+  }
+  else if (t->kind == nat_timer_conn) {
+    struct sr_nat_connection *conn = (struct sr_nat_connection *)t->owner;
+    time_t expires = sr_nat_conn_expires(sh, conn);
+    if (expires > now) {
+      sr_nat_timer_arm(sh, t, expires);
+    }
+    else {
+      sr_nat_free_conn(sh, conn);
+    }
+  }
+  else {
+    struct sr_nat_mapping *map = (struct sr_nat_mapping *)t->owner;
+    time_t expires = map->last_updated + sr_nat_idle_timeout(sh->nat, map->type);
+    if (expires > now) {
+      sr_nat_timer_arm(sh, t, expires);
+    }
+    else {
+      sr_nat_free_mapping(sh, map);
+    }
+  }
+}
+
+/* Run the shard's wheel up to curtime: only the slots that came due are
+   visited. Caller holds the lock. */
+static void sr_nat_shard_expire(struct sr_nat_shard *sh, time_t curtime) {
+  while (sh->wheel_now <= curtime) {
+    struct sr_nat_timer *t;
+
+    /* a new upper level period starts: spread its slot over the lower level */
+    if ((sh->wheel_now & SR_NAT_WHEEL_MASK) == 0) {
+      struct sr_nat_timer **slot =
+        &(sh->wheel[1][(sh->wheel_now >> SR_NAT_WHEEL_BITS) & SR_NAT_WHEEL_MASK]);
+      t = *slot;
+      *slot = NULL;
+      while (t) {
+        struct sr_nat_timer *next = t->next;
+        t->pprev = NULL;
+        sr_nat_timer_add(sh, t);
+        t = next;
+      }
+    }
+
+    /* whatever fire re-arms lands in a later slot, so this terminates */
+    while ((t = sh->wheel[0][sh->wheel_now & SR_NAT_WHEEL_MASK])) {
+      sr_nat_timer_del(t);
+      sr_nat_timer_fire(sh, t, curtime);
+    }
+    sh->wheel_now++;
+  }
+}
 
 void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
   struct sr_nat *nat = (struct sr_nat *)nat_ptr;
+  struct sr_nat_mapping *retired[SR_NAT_SHARDS];
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
     time_t curtime = time(NULL);
-    /* handle periodic tasks here */
-    struct sr_nat_mapping* map = nat->mappings; 
-    struct sr_nat_mapping* prev = NULL;
-    while (map){
-      /* handle imcp timeout*/
-      struct sr_nat_mapping* next = map->next;
-      if (map->type == nat_mapping_icmp){
-        if (difftime(curtime, map->last_updated) >= nat->icmp_query_timeout){
-          /* free mapping in the middle of linked list*/
-          if(prev){
-            free(map);
-            prev->next = next;
-            map = next;
-          }
-          /* free top of the linked list*/
-          else{
-            free(map);
-            map = next;
-            nat->mappings = map;
-          }
-        }
-        else{
-          prev = map;
-          map = next;
-        }
-      }
+    int i, any = 0;
+    /* handle periodic tasks here, one shard at a time so lookups on the
+       other shards go on */
+    for (i = 0; i < SR_NAT_SHARDS; i++) {
+      struct sr_nat_shard *sh = &(nat->shards[i]);
+      pthread_mutex_lock(&(sh->lock));
+      sr_nat_shard_expire(sh, curtime);
+      retired[i] = sh->retired;
+      sh->retired = NULL;
+      any |= (retired[i] != NULL);
+      pthread_mutex_unlock(&(sh->lock));
+    }
 
-      /* handle tcp timeout */
-      else{
-        struct sr_nat_connection *connection = map->conns;
-        struct sr_nat_connection *prev_conn = NULL;
-        while (connection){
-          struct sr_nat_connection *next_conn = connection->next;
-          switch (connection->state){
-            case SYN_SENT:
-            case SYN_RCVD:
-            case CLOSING:
-            case LAST_ACK:
-              if (difftime(curtime, connection->last_updated) >= nat->tcp_trans_timeout){
-                if(prev_conn){
-                  free(connection);
-                  prev_conn->next = next_conn;
-                  connection = next_conn;
-                }
-                /* free top of the linked list*/
-                else{
-                  free(connection);
-                  connection = next_conn;
-                  map->conns = connection;
-                }
-              }
-              else{
-                prev_conn = connection;
-                connection = next_conn;
-              }
-              break;
-            case ESTAB:
-            case FIN_WAIT_1:
-            case FIN_WAIT_2:
-            case CLOSE_WAIT:
-              if (difftime(curtime, connection->last_updated) >= nat->tcp_est_timeout){
-                if(prev_conn){
-                  free(connection);
-                  prev_conn->next = next_conn;
-                  connection = next_conn;
-                }
-                /* free top of the linked list*/
-                else{
-                  free(connection);
-                  connection = next_conn;
-                  map->conns = connection;
-                }
-              }
-              else{
-                prev_conn = connection;
-                connection = next_conn;
-              }
-              break;
-          }
+    /* wait out readers of retired mappings without holding any lock */
+    if (any) {
+      sr_epoch_synchronize(&(nat->epoch));
+      for (i = 0; i < SR_NAT_SHARDS; i++) {
+        struct sr_nat_shard *sh = &(nat->shards[i]);
+        if (!retired[i]) {
+          continue;
         }
-        if (!map->conns){
-          if(prev){
-            free(map);
-            prev->next = next;
-            map = next;
-          }
-          /* free top of the linked list*/
-          else{
-            free(map);
-            map = next;
-            nat->mappings = map;
-          }
-        }
-        else{
-          prev = map;
-          map = next;
+        pthread_mutex_lock(&(sh->lock));
+        while (retired[i]) {
+          struct sr_nat_mapping *next = retired[i]->next;
+          sr_slab_free(&(sh->map_pool), retired[i]);
+          retired[i] = next;
         }
+        pthread_mutex_unlock(&(sh->lock));
       }
     }
-    pthread_mutex_unlock(&(nat->lock));
+
+    if (nat->snapshot_next && nat->snapshot_interval > 0 &&
+        curtime >= nat->snapshot_next) {
+      sr_nat_save(nat, nat->snapshot_file);
+      nat->snapshot_next = curtime + nat->snapshot_interval;
+    }
   }
   return NULL;
 }
   
 
 
+/* Preallocate room for the given number of mappings and connections,
+   spread evenly over the shards, so setting them up does not go through
+   malloc. */
+int sr_nat_reserve(struct sr_nat *nat, unsigned long mappings, unsigned long conns) {
+  int i;
+  int ret = 0;
+
+  for (i = 0; i < SR_NAT_SHARDS && ret == 0; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    pthread_mutex_lock(&(sh->lock));
+    ret = sr_slab_reserve(&(sh->map_pool), (mappings + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS);
+    if (ret == 0) {
+      ret = sr_slab_reserve(&(sh->conn_pool), (conns + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS);
+    }
+    pthread_mutex_unlock(&(sh->lock));
+  }
+  return ret;
+}
+
+/* Add the occupancy counters of pool to sum. The peak of the sum is the
+   sum of the shards' peaks, an upper bound of the real one. */
+static void sr_nat_pool_sum(struct sr_slab *sum, const struct sr_slab *pool) {
+  sum->in_use += pool->in_use;
+  sum->capacity += pool->capacity;
+  sum->peak += pool->peak;
+  sum->grows += pool->grows;
+}
+
+/* Print the size of the table, the occupancy of its record pools and
+   the hosts that were refused over a per host limit. */
+void sr_nat_print_stats(struct sr_nat *nat) {
+  struct sr_slab maps, conns, blocks, hosts;
+  unsigned long nmappings = 0, nconns = 0, nhosts = 0;
+  unsigned long quota_drops = 0, rate_drops = 0;
+  char buf[INET_ADDRSTRLEN];
+  unsigned int b;
+  int i;
+
+  memset(&maps, 0, sizeof(maps));
+  memset(&conns, 0, sizeof(conns));
+  memset(&blocks, 0, sizeof(blocks));
+  memset(&hosts, 0, sizeof(hosts));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    pthread_mutex_lock(&(sh->lock));
+    nmappings += sh->nmappings;
+    nconns += sh->nconns;
+    nhosts += sh->nhosts;
+    quota_drops += sh->quota_drops;
+    rate_drops += sh->rate_drops;
+    sr_nat_pool_sum(&maps, &(sh->map_pool));
+    sr_nat_pool_sum(&conns, &(sh->conn_pool));
+    sr_nat_pool_sum(&blocks, &(sh->block_pool));
+    sr_nat_pool_sum(&hosts, &(sh->host_pool));
+    pthread_mutex_unlock(&(sh->lock));
+  }
+  printf("NAT: %lu mappings, %lu tcp connections\n", nmappings, nconns);
+  sr_slab_print_stats("mappings", &maps);
+  sr_slab_print_stats("connections", &conns);
+  sr_slab_print_stats("port blocks", &blocks);
+  sr_slab_print_stats("hosts", &hosts);
+  if (!sr_nat_host_limits(nat)) {
+    return;
+  }
+
+  printf("NAT: %lu hosts tracked, %lu refused over quota, %lu over rate\n",
+    nhosts, quota_drops, rate_drops);
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    pthread_mutex_lock(&(sh->lock));
+    for (b = 0; b < SR_NAT_HOST_HASH && sh->nhosts; b++) {
+      struct sr_nat_host *host;
+      for (host = sh->host_hash[b]; host; host = host->next) {
+        if (!host->quota_drops && !host->rate_drops) {
+          continue;
+        }
+        inet_ntop(AF_INET, &(host->ip_int), buf, sizeof(buf));
+        printf(" %-15s %6u mappings %6u conns %8lu over quota %8lu over rate\n",
+          buf, host->nmappings, host->nconns, host->quota_drops, host->rate_drops);
+      }
+    }
+    pthread_mutex_unlock(&(sh->lock));
+  }
+}
+
+
 /* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type, uint32_t src_ip, uint16_t src_port, int ack, int syn, int fin, int is_first_time) {
+   The result points into the table, see sr_nat.h. */
+const struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type, uint32_t src_ip, uint16_t src_port, int ack, int syn, int fin, int is_first_time) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *sh = sr_nat_shard_ext(nat, aux_ext);
+  struct sr_nat_addr *addr = sr_nat_addr_find(nat, ip_ext);
+  if (!sh || !addr) {
+    return NULL;
+  }
+  pthread_mutex_lock(&(sh->lock));
 
-  /* handle lookup here, malloc and assign to copy */
+  /* handle lookup here */
   time_t now = time(NULL);
-  struct sr_nat_mapping *current = nat->mappings;
-  struct sr_nat_mapping *copy = NULL; 
-  printf("begin to find internal ip with external port %d\n",  aux_ext);
-  while(current != NULL){
-    printf("current mapping: ip_int = %d, ip_ext = %d, aux_int = %d, aux_ext = %d\n", current->ip_int, current->ip_ext, current->aux_int, current->aux_ext);
-    printf("type match: %d; port match: %d\n", current->type==type, current->aux_ext==aux_ext);
-    if(current->type==type && current->aux_ext==aux_ext){
-      printf("sucessfully find the internal ip with external port %d\n", aux_ext);
-      if (is_first_time){
-        if (!ack && syn && !fin){
-          struct sr_nat_connection* new_conn = (struct sr_nat_connection*)malloc(sizeof(struct sr_nat_connection));
-          new_conn->next = current->conns;
-          new_conn->outhost_port = src_port;
-          new_conn->outhost_ip = src_ip;
-          new_conn->state = SYN_RCVD;
-          new_conn->last_updated = now;
-          current->conns = new_conn;
-        }
-        else{
-          /*loop over each tcp connection*/
-          struct sr_nat_connection *connection = current->conns;
-          while (connection) {
-            if (connection->outhost_ip == src_ip && connection->outhost_port == src_port){
-              if (ack && !syn & !fin){
-                switch (connection->state) {
-                  case SYN_RCVD:
-                    connection->state = ESTAB;
-                    connection->last_updated = now;
-                    break;
-                  /* No need to consider TIME_WAIT and CLOSED.
-                  case CLOSING:
-                    connection->state = TIME_WAIT;
-                    break;
-                  case LAST_ACK:
-                    connection->state = CLOSED;
-                    break;*/
-                  default:
-                    break;
-                }
-              }
-              else if (!ack && !syn && fin && connection->state == ESTAB) {
-                connection->state = CLOSE_WAIT;
-              }
-              else if (ack && !syn && fin && connection->state == FIN_WAIT_1) {
-                connection->state = FIN_WAIT_2;
-              }
-              break;
+  struct sr_nat_mapping *current = addr->ext_ports[type][aux_ext];
+  if(current != NULL && type == nat_mapping_udp){
+    /* inbound traffic keeps a udp mapping alive too */
+    current->last_updated = now;
+  }
+  if(current != NULL){
+    if (is_first_time){
+      if (!ack && syn && !fin){
+        sr_nat_conn_new(sh, current, src_ip, src_port, SYN_RCVD, now, 1);
+      }
+      else{
+        /*loop over each tcp connection*/
+        struct sr_nat_connection *connection = sr_nat_conn_find(sh, current, src_ip, src_port);
+        if (connection) {
+          if (ack && !syn & !fin){
+            switch (connection->state) {
+              case SYN_RCVD:
+                connection->state = ESTAB;
+                connection->last_updated = now;
+                break;
+              /* No need to consider TIME_WAIT and CLOSED.
+              case CLOSING:
+                connection->state = TIME_WAIT;
+                break;
+              case LAST_ACK:
+                connection->state = CLOSED;
+                break;*/
+              default:
+                break;
             }
-            connection = connection->next;  
           }
+          else if (!ack && !syn && fin && connection->state == ESTAB) {
+            connection->state = CLOSE_WAIT;
+          }
+          else if (ack && !syn && fin && connection->state == FIN_WAIT_1) {
+            connection->state = FIN_WAIT_2;
+          }
+          sr_nat_conn_touch(sh, connection);
         }
       }
-      copy = (struct sr_nat_mapping*)malloc(sizeof(struct sr_nat_mapping));
-      memcpy(copy, current, sizeof(struct sr_nat_mapping));
-      break; 
     }
-    current = current->next;
   }
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  pthread_mutex_unlock(&(sh->lock));
+  return current;
 }
 
 
 /* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+   The result points into the table, see sr_nat.h. */
+const struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, uint32_t dst_ip, uint16_t dst_port, int ack, int syn, int fin, int is_first_time) {
-  pthread_mutex_lock(&(nat->lock));
-  printf("Begin to look for external port using internal.\n");
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *current = nat->mappings;
-  struct sr_nat_mapping *copy = NULL;
+  struct sr_nat_shard *sh = sr_nat_shard_int(nat, ip_int);
+  pthread_mutex_lock(&(sh->lock));
+  /* handle lookup here. */
+  struct sr_nat_mapping *current = sh->int_hash[sr_nat_int_bucket(sh, ip_int, aux_int, type)];
   time_t now = time(NULL);
   while(current != NULL){
-    printf("current mapping: ip_int = %d, ip_ext = %d, aux_int = %d, aux_ext = %d\n", current->ip_int, current->ip_ext, current->aux_int, current->aux_ext);
-    printf("type match: %d; port match: %d; ip match: %d\n", current->type==type, current->aux_int==aux_int, current->ip_int==ip_int);
     if(current->type==type && current->aux_int==aux_int && current->ip_int==ip_int){
-      printf("Found mapping with aux_ext = %d\n", current->aux_ext);
       if (is_first_time){
         if (!ack && syn && !fin){
-          struct sr_nat_connection* new_conn = (struct sr_nat_connection*)malloc(sizeof(struct sr_nat_connection));
-          new_conn->next = current->conns;
-          new_conn->outhost_port = dst_port;
-          new_conn->outhost_ip = dst_ip;
-          new_conn->state = SYN_SENT;
-          new_conn->last_updated = now;
-          current->conns = new_conn;
+          sr_nat_conn_new(sh, current, dst_ip, dst_port, SYN_SENT, now, 1);
         }
         else{
-          struct sr_nat_connection *connection = current->conns;
-          /*loop over each tcp connection*/
-          while(connection){
-            /* Check if it's the same connection*/
-            if (connection->outhost_ip == dst_ip && connection->outhost_port == dst_port){
-              if (ack && !syn && !fin) {
-                switch (connection->state) {
-                  case SYN_SENT:
-                    connection->state = ESTAB;
-                    connection->last_updated = now;
-                    break;
-                  case FIN_WAIT_1:
-                    connection->state = CLOSING;
-                    connection->last_updated = now;
-                    break;
-                  /* No need for time_wait.
-                  case FIN_WAIT_2:
-                    connection->state = TIME_WAIT;
-                    break;
-                  */
-                  default:
-                    break;
-                }
+          struct sr_nat_connection *connection = sr_nat_conn_find(sh, current, dst_ip, dst_port);
+          if (connection) {
+            if (ack && !syn && !fin) {
+              switch (connection->state) {
+                case SYN_SENT:
+                  connection->state = ESTAB;
+                  connection->last_updated = now;
+                  break;
+                case FIN_WAIT_1:
+                  connection->state = CLOSING;
+                  connection->last_updated = now;
+                  break;
+                /* No need for time_wait.
+                case FIN_WAIT_2:
+                  connection->state = TIME_WAIT;
+                  break;
+                */
+                default:
+                  break;
               }
-              else if (!ack && !syn && fin) {
-                switch (connection->state) {
-                  case SYN_RCVD:
-                  case ESTAB:
-                    connection->state = FIN_WAIT_1;
-                    connection->last_updated = now;
-                    break;
-                  case CLOSE_WAIT:
-                    connection->state = LAST_ACK;
-                    connection->last_updated = now;
-                    break;
-                  default:
-                    break;
-                }
-              }
-              else if (ack && !syn && fin && connection->state == ESTAB) {
-                connection->state = CLOSE_WAIT;
+            }
+            else if (!ack && !syn && fin) {
+              switch (connection->state) {
+                case SYN_RCVD:
+                case ESTAB:
+                  connection->state = FIN_WAIT_1;
+                  connection->last_updated = now;
+                  break;
+                case CLOSE_WAIT:
+                  connection->state = LAST_ACK;
+                  connection->last_updated = now;
+                  break;
+                default:
+                  break;
               }
-              break;
             }
-            connection = connection->next;
-          } 
+            else if (ack && !syn && fin && connection->state == ESTAB) {
+              connection->state = CLOSE_WAIT;
+            }
+            sr_nat_conn_touch(sh, connection);
+          }
         }
       }
-      copy = (struct sr_nat_mapping*)malloc(sizeof(struct sr_nat_mapping));
-      memcpy(copy, current, sizeof(struct sr_nat_mapping));
       break; 
     }
-    current = current->next;
+    current = current->int_next;
   }
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  pthread_mutex_unlock(&(sh->lock));
+  return current;
 }
 
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+/* Create the mapping of (ip_int, aux_int) in its shard. Caller holds
+   the lock. */
+static struct sr_nat_mapping *sr_nat_insert_locked(struct sr_nat_shard *sh,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, uint32_t outhost_ip, uint16_t outhost_port) {
-  
-  pthread_mutex_lock(&(nat->lock));
-
-  /* handle insert here, create a mapping, and then return a copy of it */
+  struct sr_nat *nat = sh->nat;
   struct sr_nat_mapping *map= NULL;
-  /*loop to the end of list and get the largest external port number */
-  map = (struct sr_nat_mapping*)malloc(sizeof(struct sr_nat_mapping));
+  struct sr_nat_block *block = NULL;
+  struct sr_nat_host *host = NULL;
+  struct sr_nat_addr *addr;
+  int port;
+  time_t now = time(NULL);
+  if (sr_nat_host_limits(nat)) {
+    host = sr_nat_host_get(sh, ip_int, now);
+    if (!host) {
+      return NULL;
+    }
+    if (!sr_nat_host_admit(sh, host, now)) {
+      goto fail;
+    }
+  }
+  if (nat->port_block) {
+    block = sr_nat_block_get(sh, ip_int, type);
+    if (!block) {
+      goto fail;
+    }
+    addr = block->addr;
+  }
+  else {
+    addr = sr_nat_addr_pick(sh, ip_int, type);
+    if (!addr) {
+      goto fail;
+    }
+  }
+  map = (struct sr_nat_mapping*)sr_slab_alloc(&(sh->map_pool));
+  if (!map) {
+    goto fail;
+  }
   /* create a new external port number */
   /* update new mapping data */
   map->type = type;
   map->ip_int = ip_int;
-  map->ip_ext = nat->ip_ext;
+  map->ip_ext = addr->ip;
   map->aux_int = aux_int;
-  map->aux_ext = nat->max_port + 1;
+  map->block = block;
+  map->host = host;
+  if (block) {
+    port = sr_nat_block_port_alloc(sh, block, type);
+  }
+  else {
+    port = sr_nat_port_alloc(sh, addr, type);
+  }
+  if (port < 0) {
+    sr_slab_free(&(sh->map_pool), map);
+    fprintf(stderr, "** NAT: no external port left for a new mapping\n");
+    goto fail;
+  }
+  map->aux_ext = port;
 
-  time_t now = time(NULL);
   map->last_updated = now;
-  /* handle icmp */
-  if(type == nat_mapping_icmp){
-    map->conns = NULL; 
+  map->conns = NULL;
+  map->timer.pprev = NULL;
+  map->timer.kind = nat_timer_mapping;
+  map->timer.owner = map;
+  /* handle icmp and udp: the mapping times out by itself */
+  if(type == nat_mapping_icmp || type == nat_mapping_udp){
+    sr_nat_timer_arm(sh, &(map->timer), now + sr_nat_idle_timeout(nat, type));
   }
   /* handle tcp */
   else if(type==nat_mapping_tcp){
-    struct sr_nat_connection* new_conn = (struct sr_nat_connection*)malloc(sizeof(struct sr_nat_connection));
-    new_conn->next = NULL;
-    new_conn->outhost_port = outhost_port;
-    new_conn->outhost_ip = outhost_ip;
-    new_conn->state = SYN_SENT;
-    new_conn->last_updated = now;
-    map->conns = new_conn;
-  }
-  nat->max_port = map->aux_ext;
-  map->next = nat->mappings;
-  nat->mappings = map;
-
-  pthread_mutex_unlock(&(nat->lock));
-  struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
-  memcpy(copy, map, sizeof(struct sr_nat_mapping));
-  printf("Assigned copy: ip_int = %d, ip_ext = %d, aux_int = %d, aux_ext = %d\n", copy->ip_int, copy->ip_ext, copy->aux_int, copy->aux_ext);
-  return copy;
+    if (!sr_nat_conn_new(sh, map, outhost_ip, outhost_port, SYN_SENT, now, 1)) {
+      sr_nat_port_free(sh, addr, type, map->aux_ext);
+      sr_slab_free(&(sh->map_pool), map);
+      goto fail;
+    }
+  }
+  if (block) {
+    block->nmappings++;
+  }
+  if (host) {
+    host->nmappings++;
+    if (nat->host_rate) {
+      host->tokens--;
+    }
+  }
+  map->prev = NULL;
+  map->next = sh->mappings;
+  if (map->next) {
+    map->next->prev = map;
+  }
+  sh->mappings = map;
+  sr_nat_int_link(sh, map);
+  addr->ext_ports[type][map->aux_ext] = map;
+  return map;
+
+fail:
+  /* give back a block the host was assigned on the way; nothing was
+     charged to its host record */
+  if (block) {
+    sr_nat_block_put(sh, block);
+  }
+  if (host) {
+    sr_nat_host_idle(sh, host, now);
+  }
+  return NULL;
+}
+
+
+/* Insert a new mapping into the nat's mapping table.
+   Returns the mapping in the table, see sr_nat.h.
+ */
+const struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, uint32_t outhost_ip, uint16_t outhost_port) {
+  
+  struct sr_nat_shard *sh = sr_nat_shard_int(nat, ip_int);
+  pthread_mutex_lock(&(sh->lock));
+
+  /* handle insert here, create a mapping, and then return it */
+  struct sr_nat_mapping *map = sr_nat_insert_locked(sh, ip_int, aux_int, type,
+    outhost_ip, outhost_port);
+  /* in CGNAT mode the port block assignment is the log record */
+  if (map && !nat->port_block) {
+    printf("Assigned mapping: ip_int = %d, ip_ext = %d, aux_int = %d, aux_ext = %d\n", map->ip_int, map->ip_ext, map->aux_int, map->aux_ext);
+  }
+  pthread_mutex_unlock(&(sh->lock));
+  return map;
+}
+
+
+/* Mapping for an outbound udp packet from (ip_int, aux_int): found or
+   created under a single lock hold, idle timer refreshed. UDP flows are
+   short and many, so this skips the tcp state and the logging of the
+   generic calls. Returns NULL when the shard is out of ports. */
+const struct sr_nat_mapping *sr_nat_udp_outbound(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int) {
+  struct sr_nat_shard *sh = sr_nat_shard_int(nat, ip_int);
+  struct sr_nat_mapping *map;
+
+  pthread_mutex_lock(&(sh->lock));
+  map = sh->int_hash[sr_nat_int_bucket(sh, ip_int, aux_int, nat_mapping_udp)];
+  while (map && !(map->type == nat_mapping_udp && map->aux_int == aux_int &&
+                  map->ip_int == ip_int)) {
+    map = map->int_next;
+  }
+  if (map) {
+    /* lazily re-armed when its timer comes due */
+    map->last_updated = time(NULL);
+  }
+  else {
+    map = sr_nat_insert_locked(sh, ip_int, aux_int, nat_mapping_udp, 0, 0);
+  }
+  pthread_mutex_unlock(&(sh->lock));
+  return map;
+}
+
+
+/* Write the mappings of sh and their connections to fp. Caller holds
+   the lock. */
+static int sr_nat_save_shard(struct sr_nat_shard *sh, FILE *fp, time_t now,
+  struct sr_nat_image_hdr *hdr) {
+  struct sr_nat_mapping *map;
+  struct sr_nat_connection *conn;
+  struct sr_nat_image_map im;
+  struct sr_nat_image_conn ic;
+
+  for (map = sh->mappings; map; map = map->next) {
+    memset(&im, 0, sizeof(im));
+    im.ip_int = map->ip_int;
+    im.ip_ext = map->ip_ext;
+    im.aux_int = map->aux_int;
+    im.aux_ext = map->aux_ext;
+    im.type = map->type;
+    im.age = now - map->last_updated;
+    for (conn = map->conns; conn; conn = conn->next) {
+      im.nconns++;
+    }
+    if (fwrite(&im, sizeof(im), 1, fp) != 1) {
+      return -1;
+    }
+    for (conn = map->conns; conn; conn = conn->next) {
+      ic.outhost_ip = conn->outhost_ip;
+      ic.outhost_port = conn->outhost_port;
+      ic.state = conn->state;
+      ic.age_initialized = now - conn->initialized;
+      ic.age_updated = now - conn->last_updated;
+      if (fwrite(&ic, sizeof(ic), 1, fp) != 1) {
+        return -1;
+      }
+    }
+    hdr->nmappings++;
+    hdr->nconns += im.nconns;
+  }
+  return 0;
+}
+
+int sr_nat_save(struct sr_nat *nat, const char *filename) {
+  struct sr_nat_image_hdr hdr;
+  char tmp[1024];
+  time_t now = time(NULL);
+  FILE *fp;
+  int i, err = 0;
+
+  if (!filename || snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  pthread_mutex_lock(&(nat->snapshot_lock));
+  if ((fp = fopen(tmp, "wb")) == NULL) {
+    perror("fopen");
+    pthread_mutex_unlock(&(nat->snapshot_lock));
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SR_NAT_IMAGE_MAGIC;
+  hdr.version = SR_NAT_IMAGE_VERSION;
+  hdr.saved = now;
+  err |= fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  /* one shard at a time, like the timeout thread */
+  for (i = 0; i < SR_NAT_SHARDS && !err; i++) {
+    struct sr_nat_shard *sh = &(nat->shards[i]);
+    pthread_mutex_lock(&(sh->lock));
+    err |= sr_nat_save_shard(sh, fp, now, &hdr);
+    pthread_mutex_unlock(&(sh->lock));
+  }
+  if (!err) {
+    rewind(fp);
+    err |= fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  }
+  err |= fclose(fp) != 0;
+  if (!err) {
+    err |= rename(tmp, filename) != 0;
+  }
+  if (err) {
+    fprintf(stderr, "** NAT: writing snapshot %s failed\n", filename);
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&(nat->snapshot_lock));
+  return err ? -1 : 0;
+}
+
+/* Put the mapping of snapshot record im and its connections ic back into
+   sh, with its times rebased on now. Returns 0, or -1 if it does not fit
+   the table as configured now or memory runs out. Per host limits are
+   not applied. Caller holds the lock. */
+static int sr_nat_restore_mapping(struct sr_nat_shard *sh,
+  const struct sr_nat_image_map *im, const struct sr_nat_image_conn *ic,
+  time_t now) {
+  struct sr_nat *nat = sh->nat;
+  unsigned int s = sh - nat->shards;
+  sr_nat_mapping_type type = (sr_nat_mapping_type)im->type;
+  struct sr_nat_addr *addr = sr_nat_addr_find(nat, im->ip_ext);
+  struct sr_nat_block *block = NULL;
+  struct sr_nat_mapping *map;
+  unsigned int i;
+
+  if (!addr || im->type >= SR_NAT_NTYPES || sr_nat_shard_ext(nat, im->aux_ext) != sh ||
+      (addr->port_map[type][im->aux_ext >> 5] & (1U << (im->aux_ext & 31))) ||
+      (type == nat_mapping_tcp && im->nconns == 0)) {
+    return -1;
+  }
+  if (nat->port_block) {
+    /* the host gets back the block its port is from */
+    unsigned int j = (im->aux_ext - sh->port_lo) / nat->port_block;
+    unsigned int w = sh->port_lo / 32 + j * (nat->port_block / 32);
+    block = sr_nat_block_find(sh, im->ip_int);
+    if (!block) {
+      if (j >= (sh->port_hi - sh->port_lo) / nat->port_block ||
+          (addr->block_map[w >> 5] & (1U << (w & 31)))) {
+        return -1;
+      }
+      block = sr_nat_block_take(sh, addr, im->ip_int, w);
+      if (!block) {
+        return -1;
+      }
+    }
+    if (block->addr != addr || im->aux_ext < block->first ||
+        im->aux_ext >= block->first + nat->port_block) {
+      sr_nat_block_put(sh, block);
+      return -1;
+    }
+  }
+
+  map = (struct sr_nat_mapping *)sr_slab_alloc(&(sh->map_pool));
+  if (!map) {
+    if (block) {
+      sr_nat_block_put(sh, block);
+    }
+    return -1;
+  }
+  map->type = type;
+  map->ip_int = im->ip_int;
+  map->ip_ext = im->ip_ext;
+  map->aux_int = im->aux_int;
+  map->aux_ext = im->aux_ext;
+  map->last_updated = now - im->age;
+  map->conns = NULL;
+  map->block = block;
+  /* counted against the host, but restored whatever its limits are now */
+  map->host = sr_nat_host_limits(nat) ? sr_nat_host_get(sh, im->ip_int, now) : NULL;
+  map->timer.pprev = NULL;
+  map->timer.kind = nat_timer_mapping;
+  map->timer.owner = map;
+  addr->port_map[type][map->aux_ext >> 5] |= 1U << (map->aux_ext & 31);
+  addr->used[s][type]++;
+  if (block) {
+    block->nmappings++;
+  }
+  if (map->host) {
+    map->host->nmappings++;
+  }
+  map->prev = NULL;
+  map->next = sh->mappings;
+  if (map->next) {
+    map->next->prev = map;
+  }
+  sh->mappings = map;
+  sr_nat_int_link(sh, map);
+  addr->ext_ports[type][map->aux_ext] = map;
+
+  if (type == nat_mapping_icmp || type == nat_mapping_udp) {
+    sr_nat_timer_arm(sh, &(map->timer), map->last_updated + sr_nat_idle_timeout(nat, type));
+    return 0;
+  }
+  for (i = 0; i < im->nconns; i++) {
+    struct sr_nat_connection *conn = sr_nat_conn_new(sh, map, ic[i].outhost_ip,
+      ic[i].outhost_port, (connection_state)ic[i].state, now, 0);
+    if (conn) {
+      conn->initialized = now - ic[i].age_initialized;
+      conn->last_updated = now - ic[i].age_updated;
+      sr_nat_conn_touch(sh, conn);
+    }
+  }
+  if (!map->conns) {
+    /* out of memory for all of them */
+    sr_nat_free_mapping(sh, map);
+    return -1;
+  }
+  return 0;
+}
+
+int sr_nat_restore(struct sr_nat *nat, const char *filename) {
+  const struct sr_nat_image_hdr *hdr;
+  struct stat st;
+  uint8_t *image;
+  size_t off, end;
+  time_t now = time(NULL);
+  uint32_t i;
+  int fd, restored = 0;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    perror("open");
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+    fprintf(stderr, "NAT snapshot %s is truncated\n", filename);
+    close(fd);
+    return -1;
+  }
+  image = (uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  hdr = (const struct sr_nat_image_hdr *)image;
+  end = st.st_size;
+  if (hdr->magic != SR_NAT_IMAGE_MAGIC || hdr->version != SR_NAT_IMAGE_VERSION ||
+      end != sizeof(*hdr) + (size_t)hdr->nmappings * sizeof(struct sr_nat_image_map) +
+             (size_t)hdr->nconns * sizeof(struct sr_nat_image_conn)) {
+    fprintf(stderr, "NAT snapshot %s is not valid for this build\n", filename);
+    munmap(image, st.st_size);
+    return -1;
+  }
+
+  /* ages are rebased on now: the time the router was down for the
+     restart does not count as idle time */
+  off = sizeof(*hdr);
+  for (i = 0; i < hdr->nmappings; i++) {
+    const struct sr_nat_image_map *im = (const struct sr_nat_image_map *)(image + off);
+    const struct sr_nat_image_conn *ic;
+    struct sr_nat_shard *sh;
+
+    if (end - off < sizeof(*im) ||
+        (end - off - sizeof(*im)) / sizeof(*ic) < im->nconns) {
+      break;
+    }
+    off += sizeof(*im);
+    ic = (const struct sr_nat_image_conn *)(image + off);
+    off += im->nconns * sizeof(*ic);
+
+    sh = sr_nat_shard_int(nat, im->ip_int);
+    pthread_mutex_lock(&(sh->lock));
+    if (sr_nat_restore_mapping(sh, im, ic, now) == 0) {
+      restored++;
+    }
+    pthread_mutex_unlock(&(sh->lock));
+  }
+  munmap(image, st.st_size);
+  return restored;
 }
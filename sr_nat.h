@@ -5,11 +5,13 @@
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include "sr_slab.h"
+#include "sr_epoch.h"
 
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
 
 typedef enum {
@@ -27,6 +29,34 @@ typedef int Boolean;
 #define true 1
 #define false 0
 
+#define SR_NAT_HASH_INIT 1024  /* initial buckets of the internal index */
+#define SR_NAT_NTYPES    (nat_mapping_udp + 1)
+#define SR_NAT_PORTS     65536
+#define SR_NAT_PORT_MIN  1024  /* external ports below this are never handed out */
+#define SR_NAT_PORT_WORDS (SR_NAT_PORTS / 32)
+#define SR_NAT_SLAB_GROW 1024  /* records added when a pool runs dry */
+
+/* Expiry runs on a two level timer wheel: 256 one second slots, then 256
+   slots of 256 seconds each that are cascaded down as their turn comes. */
+#define SR_NAT_WHEEL_BITS   8
+#define SR_NAT_WHEEL_SIZE   (1 << SR_NAT_WHEEL_BITS)
+#define SR_NAT_WHEEL_MASK   (SR_NAT_WHEEL_SIZE - 1)
+#define SR_NAT_WHEEL_LEVELS 2
+
+typedef enum {
+  nat_timer_mapping,
+  nat_timer_conn,
+  nat_timer_host
+} sr_nat_timer_kind;
+
+struct sr_nat_timer {
+  struct sr_nat_timer *next;
+  struct sr_nat_timer **pprev; /* link pointing at us, NULL when not armed */
+  time_t expires;
+  sr_nat_timer_kind kind;
+  void *owner; /* the mapping, connection or host that expires */
+};
+
 
 
 
@@ -38,6 +68,10 @@ struct sr_nat_connection {
   uint32_t outhost_port;
   time_t last_updated; /* use to timeout connection */
   struct sr_nat_connection *next;
+  struct sr_nat_connection *prev;
+  struct sr_nat_connection *hnext; /* chain in nat->conn_hash */
+  struct sr_nat_mapping *mapping; /* mapping this connection belongs to */
+  struct sr_nat_timer timer;
 };
 
 
@@ -50,19 +84,143 @@ struct sr_nat_mapping {
   time_t last_updated; /* use to timeout mappings */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *prev;
+  struct sr_nat_mapping *int_next; /* chain in nat->int_hash */
+  struct sr_nat_block *block; /* port block the external port is from, CGNAT mode */
+  struct sr_nat_host *host; /* limits of ip_int, NULL when there are none */
+  struct sr_nat_timer timer; /* icmp and udp, tcp mappings go with their last connection */
+};
+
+
+struct sr_nat;
+struct sr_nat_addr;
+
+/* CGNAT mode (nat->port_block != 0): every internal host gets a block of
+   port_block consecutive external ports, the same for each type, on one
+   address of the pool. It is assigned with the host's first mapping and
+   given back with its last; in between new mappings only search the
+   block, and only assignments and releases are logged. */
+#define SR_NAT_BLOCK_HASH 1024  /* buckets of a shard's block index */
+
+struct sr_nat_block {
+  uint32_t ip_int;
+  struct sr_nat_addr *addr;
+  unsigned int first; /* first port, a multiple of 32 */
+  unsigned int nmappings; /* of every type */
+  unsigned int cursor[SR_NAT_NTYPES]; /* bitmap word the next search starts at */
+  struct sr_nat_block *next; /* chain in block_hash */
+};
+
+/* Per internal host limits, all off when 0: nat->host_max_mappings
+   concurrent mappings, nat->host_max_conns concurrent tcp connections
+   and a token bucket of nat->host_burst new mappings refilled with
+   nat->host_rate a second. A host keeps its record, and so its bucket,
+   until it has no mapping or connection left and its bucket is full
+   again; if it is still refilling then, the record's timer goes off when
+   it is full. */
+#define SR_NAT_HOST_HASH 1024  /* buckets of a shard's host index */
+
+struct sr_nat_host {
+  uint32_t ip_int;
+  unsigned int nmappings;
+  unsigned int nconns;
+  unsigned int tokens;
+  time_t refilled; /* last second tokens were added */
+  unsigned long quota_drops; /* mappings and connections refused over a cap */
+  unsigned long rate_drops; /* mappings refused for lack of tokens */
+  struct sr_nat_host *next; /* chain in host_hash */
+  struct sr_nat_timer timer; /* retires an idle record once its bucket is full */
+};
+
+/* The table is split in SR_NAT_SHARDS shards, each with its own lock,
+   indexes, record pools and timer wheel. Outbound packets pick a shard
+   from the internal address, so everything of one host lives together;
+   each shard hands out external ports from its own slice of the port
+   space, so inbound packets find the shard from the destination port. */
+#define SR_NAT_SHARDS 8  /* power of two */
+#define SR_NAT_SHARD_SPAN (((SR_NAT_PORTS - SR_NAT_PORT_MIN) / SR_NAT_SHARDS) & ~31)
+
+struct sr_nat_shard {
+  struct sr_nat *nat;
+  unsigned int port_lo, port_hi; /* external ports [lo, hi) owned here */
+  struct sr_nat_mapping *mappings;
+  /* index on (type, ip_int, aux_int), grown to keep chains short */
+  struct sr_nat_mapping **int_hash;
+  unsigned int int_hash_size; /* power of two */
+  unsigned int nmappings;
+  /* tcp connections indexed on the 5-tuple (ip_int, aux_int, outhost) */
+  struct sr_nat_connection **conn_hash;
+  unsigned int conn_hash_size; /* power of two */
+  unsigned int nconns;
+  /* port blocks of the shard's hosts, CGNAT mode */
+  struct sr_nat_block **block_hash;
+  unsigned int nblocks;
+  struct sr_slab block_pool;
+  /* per host limits */
+  struct sr_nat_host **host_hash;
+  unsigned int nhosts;
+  struct sr_slab host_pool;
+  unsigned long quota_drops; /* totals of the shard's hosts */
+  unsigned long rate_drops;
+  /* mapping and connection records */
+  struct sr_slab map_pool;
+  struct sr_slab conn_pool;
+  struct sr_nat_mapping *retired; /* unlinked, freed after a grace period */
+  /* pending expiries */
+  struct sr_nat_timer *wheel[SR_NAT_WHEEL_LEVELS][SR_NAT_WHEEL_SIZE];
+  time_t wheel_now; /* next second the wheel will process */
+  pthread_mutex_t lock;
 };
 
+/* One external address of the pool. Every address has the whole port
+   space, split between the shards as above; a shard only touches the
+   bitmap words, ext_ports slots and row of used/port_cursor that belong
+   to it. */
+#define SR_NAT_ADDRS_MAX 64
+
+typedef enum {
+  nat_pool_paired,      /* all mappings of an internal host use one address */
+  nat_pool_least_loaded /* each new mapping takes the emptiest address */
+} sr_nat_pool_policy;
+
+struct sr_nat_addr {
+  uint32_t ip; /* network byte order */
+  /* external ports / icmp ids in use, one bit each, per type */
+  uint32_t port_map[SR_NAT_NTYPES][SR_NAT_PORT_WORDS];
+  /* mapping owning each external port / icmp id, per type */
+  struct sr_nat_mapping *ext_ports[SR_NAT_NTYPES][SR_NAT_PORTS];
+  unsigned int used[SR_NAT_SHARDS][SR_NAT_NTYPES]; /* mappings per shard */
+  unsigned int port_cursor[SR_NAT_SHARDS][SR_NAT_NTYPES]; /* bitmap word the next search starts at */
+  /* CGNAT mode: bit w set when port word w starts an assigned block */
+  uint32_t block_map[SR_NAT_PORT_WORDS / 32];
+  unsigned int block_cursor[SR_NAT_SHARDS]; /* word the next block search starts at */
+};
 
 struct sr_nat {
   /* add any fields here */
   int icmp_query_timeout;  /* ICMP query timeout interval in seconds */
   int tcp_est_timeout;  /* TCP Established Idle Timeout in seconds */
   int tcp_trans_timeout;  /* TCP Transitory Idle Timeout in seconds */
-  uint32_t ip_ext;
-  uint16_t max_port;
-  struct sr_nat_mapping *mappings;
+  int udp_timeout;  /* UDP Idle Timeout in seconds */
+  /* external address pool, sorted by address; filled before the first
+     packet and fixed afterwards */
+  struct sr_nat_addr *addrs[SR_NAT_ADDRS_MAX];
+  unsigned int naddrs;
+  sr_nat_pool_policy pool_policy;
+  unsigned int port_block; /* ports per host block, multiple of 32; 0 = off */
+  unsigned int host_max_mappings; /* per host limits, see sr_nat_host */
+  unsigned int host_max_conns;
+  unsigned int host_rate;
+  unsigned int host_burst;
+  /* snapshot of the table for a warm restart, see sr_nat_save */
+  const char *snapshot_file; /* NULL = none */
+  int snapshot_interval; /* seconds between periodic snapshots */
+  volatile time_t snapshot_next; /* 0 until the table is live */
+  pthread_mutex_t snapshot_lock; /* one writer of the file at a time */
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  /* readers of mappings handed out by the lookups, see below */
+  struct sr_epoch epoch;
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
@@ -72,24 +230,98 @@ struct sr_nat {
 int   sr_nat_init(struct sr_nat *nat);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+int   sr_nat_reserve(struct sr_nat *nat, unsigned long mappings, unsigned long conns);
+void  sr_nat_print_stats(struct sr_nat *nat);  /* Table size and pool occupancy */
+
+/* Add ip (network byte order) to the external address pool. Only call
+   before packets are translated. Returns 0, or -1 when the pool is full,
+   ip is already in it or memory runs out. */
+int   sr_nat_add_address(struct sr_nat *nat, uint32_t ip);
+/* Nonzero if ip is one of the pool's external addresses. */
+int   sr_nat_is_external(struct sr_nat *nat, uint32_t ip);
+
+
+/* ----------------------------------------------------------------------------
+ * NAT snapshot
+ *
+ * The table written to a file so a restarted router keeps its mappings
+ * and tcp connections.  A header is followed by one sr_nat_image_map per
+ * mapping, each directly followed by its nconns sr_nat_image_conn
+ * records; every record is a multiple of 4 bytes so the file can be
+ * read in place through mmap.  Times are stored as ages at hdr.saved and
+ * rebased on the clock of the restore.  The port allocators are not
+ * stored, they are rebuilt from the mappings.  Like FIB images,
+ * snapshots are only meant to be read on the machine type that wrote
+ * them.
+ * -------------------------------------------------------------------------- */
+
+#define SR_NAT_IMAGE_MAGIC   0x53524e54U  /* "SRNT" */
+#define SR_NAT_IMAGE_VERSION 1
+
+struct sr_nat_image_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nmappings;
+  uint32_t nconns;
+  int64_t  saved; /* time of the snapshot */
+};
+
+struct sr_nat_image_map {
+  uint32_t ip_int; /* network byte order */
+  uint32_t ip_ext; /* network byte order */
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint32_t type;
+  uint32_t age; /* seconds since last_updated */
+  uint32_t nconns;
+};
+
+struct sr_nat_image_conn {
+  uint32_t outhost_ip;
+  uint32_t outhost_port;
+  uint32_t state;
+  uint32_t age_initialized;
+  uint32_t age_updated;
+};
+
+/* Write the table to filename (through a temporary file renamed over
+   it). Returns 0 on success. */
+int   sr_nat_save(struct sr_nat *nat, const char *filename);
+/* Insert the mappings of snapshot filename into the empty table. Entries
+   that no longer fit (address left the pool, port taken, shard layout
+   changed) are skipped. Returns the number of mappings restored, -1 if
+   the file cannot be used. */
+int   sr_nat_restore(struct sr_nat *nat, const char *filename);
 
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type, uint32_t src_ip, uint16_t src_port, int ack, int syn, int fin, int is_first_time);
+/* The lookups and sr_nat_insert_mapping return the mapping in the table,
+   not a copy. It stays readable until the caller leaves the nat epoch it
+   entered with sr_epoch_enter(&nat->epoch) before the call; expired
+   mappings are only recycled once every such reader is gone. Do not free
+   or modify it. */
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+/* Get the mapping associated with given external address and port. */
+const struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type, uint32_t src_ip, uint16_t src_port, int ack, int syn, int fin, int is_first_time);
+
+/* Get the mapping associated with given internal (ip, port) pair. */
+const struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, uint32_t dst_ip, uint16_t dst_port, int ack, int syn, int fin, int is_first_time);
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+   Returns NULL when every external port of the type is taken on the
+   address(es) the pool policy allows, or the host is over one of its
+   limits (see sr_nat_host). */
 /* sendsyn = 1 if tcp packet from internal to external, 0 for all other cases */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+const struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, uint32_t outhost_ip, uint16_t outhost_port);
 
+/* Find or create the mapping of an outbound udp packet in one step.
+   Returns NULL when every external port of the shard is taken or the
+   host is over one of its limits. */
+const struct sr_nat_mapping *sr_nat_udp_outbound(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int);
+
 /* Free the returned Mapping 
 */
  int free_memory(struct sr_nat_mapping* map);
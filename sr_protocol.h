@@ -178,6 +178,18 @@ struct sr_tcp_psd_hdr {
 } __attribute__ ((packed)) ;
 typedef struct sr_tcp_psd_hdr sr_tcp_psd_hdr_t;
 
+/*
+ * Structure of a udp header.
+ */
+struct sr_udp_hdr
+  {
+    uint16_t port_src;     /* source port */
+    uint16_t port_dst;     /* destination port */
+    uint16_t udp_len;      /* length of header and data */
+    uint16_t udp_sum;      /* checksum, 0 if the sender did not compute one */
+  } __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
 /* 
  *  Ethernet packet header prototype.  Too many O/S's define this differently.
  *  Easy enough to solve that and define it here.
@@ -198,6 +210,7 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
   ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
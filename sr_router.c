@@ -19,9 +19,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
@@ -50,12 +52,95 @@ void sr_init(struct sr_instance* sr)
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
+    /* SIGHUP reloads the routing table, SIGUSR1 prints statistics and
+       SIGTERM saves the NAT table before exiting; block them before any
+       thread is started so only sr_signal_thread receives them */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    sr->nat_restore = 0;
+    sr->syn_pending = NULL;
+    sr->syn_pending_tail = NULL;
+    sr->syn_npending = 0;
+    sr->syn_drops = 0;
+    pthread_mutex_init(&(sr->syn_lock), NULL);
+
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
     
     /* Add initialization code here! */
+    pthread_create(&thread, &(sr->attr), sr_signal_thread, sr);
 
 } /* -- sr_init -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_signal_thread
+ * Scope:  Global
+ *
+ * Handle the router's control signals: SIGHUP reloads sr->rtable_file,
+ * SIGUSR1 prints the NAT statistics and SIGTERM writes the NAT
+ * snapshot, if there is one, and exits.  The signals must be blocked in
+ * every thread (sr_init does this before starting any) so that only
+ * this thread's sigwait sees them.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_signal_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGTERM);
+
+    while(1)
+    {
+        if(sigwait(&set, &sig) != 0)
+        { continue; }
+
+        if(sig == SIGTERM)
+        {
+            /* snapshot_next is 0 until the table is live: do not
+               overwrite a snapshot with the empty table of a router
+               that is still starting */
+            if(sr->nat_on && sr->nat->snapshot_file && sr->nat->snapshot_next)
+            {
+                printf("SIGTERM: saving NAT table to %s\n", sr->nat->snapshot_file);
+                sr_nat_save(sr->nat, sr->nat->snapshot_file);
+            }
+            exit(0);
+        }
+
+        if(sig == SIGUSR1)
+        {
+            if(sr->nat_on)
+            {
+                sr_nat_print_stats(sr->nat);
+                printf("Inbound syns: %u held, %lu dropped\n",
+                       sr->syn_npending, sr->syn_drops);
+            }
+            continue;
+        }
+
+        printf("SIGHUP: reloading routing table from %s\n", sr->rtable_file);
+        if(sr_load_rt(sr, sr->rtable_file) != 0)
+        {
+            fprintf(stderr,"Reload of %s failed, keeping current table\n",
+                    sr->rtable_file);
+            continue;
+        }
+        sr_print_routing_table(sr);
+    }
+
+    return NULL;
+} /* -- sr_signal_thread -- */
+
 /*---------------------------------------------------------------------
  * Method: sr_handlepacket(uint8_t* p,char* interface)
  * Scope:  Global
@@ -88,12 +173,6 @@ void sr_handlepacket(struct sr_instance* sr,
 
   /* fill in code here */
 
-  /* add nat external ip address */
-  struct sr_if *nat_ext_iface; /* nat's outgoing interface */
-  nat_ext_iface = sr_get_interface(sr, EXT_INTERFACE);
-  assert(nat_ext_iface);
-  sr->nat->ip_ext = nat_ext_iface->ip;
-
   sr_ethernet_hdr_t *ethernet_hdr;
 
   if ( len < sizeof(struct sr_ethernet_hdr) ) {
@@ -104,6 +183,11 @@ void sr_handlepacket(struct sr_instance* sr,
   ethernet_hdr = (struct sr_ethernet_hdr *)packet;
   assert(ethernet_hdr);
 
+  /* next-hop handles from the FIB and NAT mappings stay valid until we
+     leave the epochs */
+  int epoch_slot = sr_epoch_enter(&(sr->fib_epoch));
+  int nat_slot = sr_epoch_enter(&(sr->nat->epoch));
+
   /* if the packet is an arp packet */
   if (ethernet_hdr->ether_type == htons(ethertype_arp)) {
     sr_handle_arp_pkt(sr, packet, len, interface);    
@@ -114,9 +198,157 @@ void sr_handlepacket(struct sr_instance* sr,
     sr_handle_ip_pkt(sr, packet, len, interface);
   }
 
+  sr_epoch_exit(&(sr->nat->epoch), nat_slot);
+  sr_epoch_exit(&(sr->fib_epoch), epoch_slot);
   return;
 }/* end sr_handlepacket */
 
+/* Called once the interfaces are known, before the first packet: gives
+ * the NAT the external interface's address if no pool was configured,
+ * reloads the snapshot if asked to and starts the periodic snapshots.
+ * Returns 0, -1 if the NAT has no external address. */
+int sr_nat_start(struct sr_instance* sr)
+{
+  struct sr_nat *nat = sr->nat;
+
+  if (nat->naddrs == 0) {
+    struct sr_if *ext = sr_get_interface(sr, EXT_INTERFACE);
+    if (!ext || sr_nat_add_address(nat, ext->ip) != 0) {
+      fprintf(stderr, "No external address for the NAT\n");
+      return -1;
+    }
+  }
+  if (nat->snapshot_file) {
+    if (sr->nat_restore) {
+      int n = sr_nat_restore(nat, nat->snapshot_file);
+      if (n >= 0) {
+        printf("Restored %d NAT mappings from %s\n", n, nat->snapshot_file);
+      }
+    }
+    /* from now on snapshots hold the live table, not an empty one */
+    nat->snapshot_next = time(NULL) + nat->snapshot_interval;
+  }
+  return 0;
+} /* end sr_nat_start */
+
+/* Hold an inbound tcp syn that matched no mapping for SR_SYN_PENDING_TO
+ * seconds (RFC 5382 REQ-4): if an internal host opens the same connection
+ * meanwhile it is dropped silently, the connection goes on with the syns
+ * the hosts send from then on; otherwise it is answered with port
+ * unreachable.
+ * The packet is copied.  When SR_SYN_PENDING_MAX syns are already held
+ * it is dropped, so a syn flood costs a bounded amount of memory and
+ * never stalls the forwarding path. */
+void sr_syn_pending_add(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */)
+{
+  struct sr_syn_pending *pending;
+
+  pthread_mutex_lock(&(sr->syn_lock));
+  if (sr->syn_npending >= SR_SYN_PENDING_MAX) {
+    sr->syn_drops++;
+    pthread_mutex_unlock(&(sr->syn_lock));
+    return;
+  }
+
+  pending = (struct sr_syn_pending *)malloc(sizeof(struct sr_syn_pending));
+  if (pending) {
+    pending->buf = (uint8_t *)malloc(len);
+  }
+  if (!pending || !pending->buf) {
+    free(pending);
+    sr->syn_drops++;
+    pthread_mutex_unlock(&(sr->syn_lock));
+    return;
+  }
+  memcpy(pending->buf, packet, len);
+  pending->len = len;
+  strncpy(pending->iface, interface, sr_IFACE_NAMELEN);
+  pending->iface[sr_IFACE_NAMELEN - 1] = '\0';
+  pending->arrived = time(NULL);
+  pending->next = NULL;
+
+  /* every syn waits equally long, so arrival order is expiry order */
+  if (sr->syn_pending_tail)
+    sr->syn_pending_tail->next = pending;
+  else
+    sr->syn_pending = pending;
+  sr->syn_pending_tail = pending;
+  sr->syn_npending++;
+  pthread_mutex_unlock(&(sr->syn_lock));
+} /* end sr_syn_pending_add */
+
+/* Called once a second from the arp cache thread: takes the syns whose
+ * wait is over off the queue.  Those without a mapping get an icmp port
+ * unreachable, sent from here like the arp thread's host unreachables;
+ * those that have a mapping now are dropped. */
+void sr_syn_pending_sweep(struct sr_instance* sr)
+{
+  struct sr_syn_pending *due, *pending;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&(sr->syn_lock));
+  due = sr->syn_pending;
+  pending = NULL;
+  while (sr->syn_pending &&
+         difftime(now, sr->syn_pending->arrived) >= SR_SYN_PENDING_TO) {
+    pending = sr->syn_pending;
+    sr->syn_pending = pending->next;
+    sr->syn_npending--;
+  }
+  if (!pending) {
+    pthread_mutex_unlock(&(sr->syn_lock));
+    return;
+  }
+  pending->next = NULL;
+  if (!sr->syn_pending)
+    sr->syn_pending_tail = NULL;
+  pthread_mutex_unlock(&(sr->syn_lock));
+
+  while (due) {
+    pending = due;
+    due = pending->next;
+
+    sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(pending->buf + 
+      sizeof(struct sr_ethernet_hdr));
+    sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *)((uint8_t *)ip_hdr + 
+      ip_hdr->ip_hl*4);
+
+    int epoch_slot = sr_epoch_enter(&(sr->fib_epoch));
+    int nat_slot = sr_epoch_enter(&(sr->nat->epoch));
+    /* a mapping means the simultaneous open went through (REQ-4) */
+    if (!sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(tcp_hdr->port_dst), 
+          nat_mapping_tcp, 0, 0, 0, 0, 0, 0)) {
+      sr_icmp_dest_unreachable(sr, pending->buf, pending->len, 
+        pending->iface, 3, 3);
+    }
+    sr_epoch_exit(&(sr->nat->epoch), nat_slot);
+    sr_epoch_exit(&(sr->fib_epoch), epoch_slot);
+
+    free(pending->buf);
+    free(pending);
+  }
+} /* end sr_syn_pending_sweep */
+
+/* Whether the router owns ip on interface: the interface's own address,
+ * or with the NAT on, any pool address given by -P on the external side,
+ * so that the upstream link can resolve them without a static route. */
+int sr_arp_target_is_mine(struct sr_instance* sr,
+        uint32_t ip,
+        char* interface)
+{
+  struct sr_if* iface = sr_get_interface(sr, interface);
+  assert(iface);
+
+  if (ip == iface->ip) {
+    return 1;
+  }
+  return sr->nat_on && strcmp(interface, EXT_INTERFACE) == 0 &&
+         sr_nat_is_external(sr->nat, ip);
+} /* end sr_arp_target_is_mine */
+
 /* helper function for sr_handlepacket()
  * if the packet is an arp packet */
 int sr_handle_arp_pkt(struct sr_instance* sr,
@@ -132,11 +364,9 @@ int sr_handle_arp_pkt(struct sr_instance* sr,
   sr_arp_hdr_t *arp_hdr;
   arp_hdr = (struct sr_arp_hdr *)(packet + sizeof(struct sr_ethernet_hdr));
   assert(arp_hdr);
-  struct sr_if* iface = sr_get_interface(sr, interface);
-  assert(iface);
 
   /* check if the arp is for me */
-  if (arp_hdr->ar_tip != iface->ip) {
+  if (!sr_arp_target_is_mine(sr, arp_hdr->ar_tip, interface)) {
     return 0;
   }
 
@@ -163,6 +393,7 @@ void sr_handle_arp_request(struct sr_instance* sr,
   sr_arp_hdr_t *arp_hdr;
   struct sr_if* iface;
   uint8_t *sr_pkt;
+  uint32_t target_ip;
 
   iface = sr_get_interface(sr, interface);
   assert(iface);
@@ -175,12 +406,13 @@ void sr_handle_arp_request(struct sr_instance* sr,
   assert(ethernet_hdr);
   assert(arp_hdr);
 
-  /* update arp header */
+  /* update arp header, answering for whichever of our addresses was asked */
+  target_ip = arp_hdr->ar_tip;
   arp_hdr->ar_op = htons(arp_op_reply);
   memcpy(arp_hdr->ar_tha, arp_hdr->ar_sha, ETHER_ADDR_LEN);
   arp_hdr->ar_tip = arp_hdr->ar_sip;    
   memcpy(arp_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
-  arp_hdr->ar_sip = iface->ip;
+  arp_hdr->ar_sip = target_ip;
 
   /* update ethernet header */
   memcpy(ethernet_hdr->ether_dhost, ethernet_hdr->ether_shost, ETHER_ADDR_LEN);
@@ -194,6 +426,39 @@ void sr_handle_arp_request(struct sr_instance* sr,
   return;
 } /* end sr_handle_arp_request */
 
+/* Rewrite the udp packet in frame for the NAT: outbound gets the mapping's
+ * external address and port as source, inbound its internal ones as
+ * destination.  The checksum is adjusted for the changed fields only; a
+ * zero checksum means the sender did not compute one and stays zero, and
+ * an adjusted sum of zero is sent as 0xffff.  TTL and the ip checksum are
+ * left to the caller. */
+static void sr_nat_translate_udp(uint8_t *frame, 
+        const struct sr_nat_mapping *nat_mapping,
+        int outbound)
+{
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+  sr_udp_hdr_t *udp_hdr = (sr_udp_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t) +
+    ip_hdr->ip_hl*4);
+
+  uint16_t sum = udp_hdr->udp_sum;
+
+  if (outbound) {
+    sum = cksum_adjust32(sum, ip_hdr->ip_src, nat_mapping->ip_ext);
+    sum = cksum_adjust16(sum, udp_hdr->port_src, htons(nat_mapping->aux_ext));
+    ip_hdr->ip_src = nat_mapping->ip_ext;
+    udp_hdr->port_src = htons(nat_mapping->aux_ext);
+  }
+  else {
+    sum = cksum_adjust32(sum, ip_hdr->ip_dst, nat_mapping->ip_int);
+    sum = cksum_adjust16(sum, udp_hdr->port_dst, htons(nat_mapping->aux_int));
+    ip_hdr->ip_dst = nat_mapping->ip_int;
+    udp_hdr->port_dst = htons(nat_mapping->aux_int);
+  }
+
+  if (udp_hdr->udp_sum)
+    udp_hdr->udp_sum = sum ? sum : 0xffff;
+} /* end sr_nat_translate_udp */
+
 /* handle arp reply to me */
 void sr_handle_arp_reply(struct sr_instance* sr,
         uint8_t * packet, 
@@ -248,7 +513,7 @@ void sr_handle_arp_reply(struct sr_instance* sr,
 
             /* printf("next is mapping for icmp = 8.\n"); */
 
-            struct sr_nat_mapping *nat_mapping;
+            const struct sr_nat_mapping *nat_mapping;
 
             /* printf("src_ip %u\n", *ip_src_int ); */
             /* printf("port_int %d\n",*aux_src_int); */
@@ -261,6 +526,10 @@ void sr_handle_arp_reply(struct sr_instance* sr,
 
               nat_mapping = sr_nat_insert_mapping(sr->nat, *ip_src_int, 
                 *aux_src_int, nat_mapping_icmp, 0, 0);
+              /* out of external ids, drop the packet */
+              if (!nat_mapping) {
+                continue;
+              }
         	  }
 
       	    ip_hdr->ip_src = nat_mapping->ip_ext;
@@ -270,19 +539,17 @@ void sr_handle_arp_reply(struct sr_instance* sr,
       	    icmp_hdr_new = (sr_icmp_t8_hdr_t *)(pkt->buf + 
       	      sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
+      	    icmp_hdr_new->icmp_sum = cksum_adjust16(icmp_hdr_new->icmp_sum,
+      	      icmp_hdr_new->icmp_id, nat_mapping->aux_ext);
       	    icmp_hdr_new->icmp_id = nat_mapping->aux_ext;
-      	    bzero(&(icmp_hdr_new->icmp_sum), 2);
-            uint16_t icmp_cksum = cksum(icmp_hdr_new, (int)ntohs(ip_hdr->ip_len)-((int)ip_hdr->ip_hl)*4);
-      	    icmp_hdr_new->icmp_sum = icmp_cksum;
-            free(nat_mapping);
         	}
       	  /* If it's an ICMP echo reply*/
-      	  else if (icmp_hdr->icmp_type == 0 && ip_hdr->ip_dst == sr->nat->ip_ext){
+      	  else if (icmp_hdr->icmp_type == 0 && sr_nat_is_external(sr->nat, ip_hdr->ip_dst)){
 	          uint16_t *aux_ext;
       	    aux_ext = (uint16_t *)(pkt->buf + sizeof(struct sr_ethernet_hdr) 
       	      + sizeof(struct sr_ip_hdr) + sizeof(struct sr_icmp_hdr));
-      	    struct sr_nat_mapping *nat_mapping;
-      	    nat_mapping = sr_nat_lookup_external(sr->nat, *aux_ext, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
+      	    const struct sr_nat_mapping *nat_mapping;
+      	    nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, *aux_ext, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
 
       	    /* If no mapping, drop the packet.*/
       	    if (!nat_mapping) {
@@ -296,11 +563,9 @@ void sr_handle_arp_reply(struct sr_instance* sr,
       	    sr_icmp_t8_hdr_t *icmp_hdr_new;
       	    icmp_hdr_new = (sr_icmp_t8_hdr_t *)(pkt->buf + 
       	      sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+      	    icmp_hdr_new->icmp_sum = cksum_adjust16(icmp_hdr_new->icmp_sum,
+      	      icmp_hdr_new->icmp_id, nat_mapping->aux_int);
       	    icmp_hdr_new->icmp_id = nat_mapping->aux_int;
-      	    bzero(&(icmp_hdr_new->icmp_sum), 2);
-      	    uint16_t icmp_cksum = cksum(icmp_hdr_new, (int)ntohs(ip_hdr->ip_len)-((int)ip_hdr->ip_hl)*4);
-      	    icmp_hdr_new->icmp_sum = icmp_cksum;
-            free(nat_mapping);
           }
 	      }
       
@@ -326,7 +591,7 @@ void sr_handle_arp_reply(struct sr_instance* sr,
             uint16_t aux_src_int = tcp_hdr->port_src;
  
             /* find nat mapping */
-            struct sr_nat_mapping *nat_mapping;
+            const struct sr_nat_mapping *nat_mapping;
             nat_mapping = sr_nat_lookup_internal(sr->nat, ip_src_int, 
               ntohs(aux_src_int), nat_mapping_tcp, ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin, 0);
 
@@ -334,20 +599,20 @@ void sr_handle_arp_reply(struct sr_instance* sr,
             if (!nat_mapping) {
               nat_mapping = sr_nat_insert_mapping(sr->nat, ip_src_int, 
                    ntohs(aux_src_int), nat_mapping_tcp, ip_hdr->ip_dst, tcp_hdr->port_dst);
+              /* out of external ports, drop the packet */
+              if (!nat_mapping) {
+                continue;
+              }
             }
 
-            /* translate ip source address */
-            ip_hdr->ip_src = nat_mapping->ip_ext;            
-            /* translate tcp source port number */
+            /* translate ip source address and tcp source port number,
+               the address is part of the pseudo header */
+            tcp_hdr->tcp_sum = cksum_adjust32(tcp_hdr->tcp_sum,
+              ip_hdr->ip_src, nat_mapping->ip_ext);
+            tcp_hdr->tcp_sum = cksum_adjust16(tcp_hdr->tcp_sum,
+              tcp_hdr->port_src, htons(nat_mapping->aux_ext));
+            ip_hdr->ip_src = nat_mapping->ip_ext;
             tcp_hdr->port_src = htons(nat_mapping->aux_ext);
-            /* recalculate tcp chechsum */
-            /*
-            bzero(&(tcp_hdr->tcp_sum), 2);
-            uint16_t tcp_cksum = cksum(tcp_hdr, len - 
-              sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-            tcp_hdr->tcp_sum = tcp_cksum;
-            */
-            free(nat_mapping);
           }
 
           /* if the tcp is from external to internal */
@@ -356,8 +621,8 @@ void sr_handle_arp_reply(struct sr_instance* sr,
             uint16_t aux_ext = ntohs(tcp_hdr->port_dst);
 
             /* find nat mapping */            
-            struct sr_nat_mapping *nat_mapping;
-            nat_mapping = sr_nat_lookup_external(sr->nat, aux_ext, nat_mapping_tcp, 
+            const struct sr_nat_mapping *nat_mapping;
+            nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, aux_ext, nat_mapping_tcp, 
               ip_hdr->ip_src, tcp_hdr->port_src, ack, syn, fin, 0);
             
             /* If no mapping, drop the packet.*/
@@ -366,48 +631,39 @@ void sr_handle_arp_reply(struct sr_instance* sr,
               return;
             }
             
-            /* translate ip destination address */
+            /* translate ip destination address and tcp destination port
+               number, the address is part of the pseudo header */
+            tcp_hdr->tcp_sum = cksum_adjust32(tcp_hdr->tcp_sum,
+              ip_hdr->ip_dst, nat_mapping->ip_int);
+            tcp_hdr->tcp_sum = cksum_adjust16(tcp_hdr->tcp_sum,
+              tcp_hdr->port_dst, htons(nat_mapping->aux_int));
             ip_hdr->ip_dst = nat_mapping->ip_int;
-            /* translate tcp destination port number */
             tcp_hdr->port_dst = htons(nat_mapping->aux_int);
-            /* recalculate tcp chechsum */
-            /*
-            bzero(&(tcp_hdr->tcp_sum), 2);
-            uint16_t tcp_cksum = cksum(tcp_hdr, len - 
-              sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-            tcp_hdr->tcp_sum = tcp_cksum;
-            */
-
-            free(nat_mapping);
           }
+        }
 
-          bzero(&(tcp_hdr->tcp_sum), 2);
-
-          /*
-          uint16_t tcp_cksum = cksum(tcp_hdr, len - 
-            sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-          tcp_hdr->tcp_sum = tcp_cksum;
-          */
+        /* If it's an UDP packet*/
+        if (ip_hdr->ip_p == ip_protocol_udp) {
+          sr_udp_hdr_t *udp_hdr;
+          udp_hdr = (sr_udp_hdr_t *)(pkt->buf + sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl*4);
+          const struct sr_nat_mapping *nat_mapping = NULL;
 
-          /* create a pseudo tcp packet for calculate tcp check sum */
-          sr_tcp_psd_hdr_t *tcp_psd_hdr;
-          int tcp_len = (int)ntohs(ip_hdr->ip_len) - (int)ip_hdr->ip_hl * 4;
-          printf("tcp_len = %d\n", tcp_len);
-          uint8_t *psd_pkt = (uint8_t *)malloc(sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-          tcp_psd_hdr = (sr_tcp_psd_hdr_t *)psd_pkt;
-          tcp_psd_hdr->ip_src = ip_hdr->ip_src;
-          tcp_psd_hdr->ip_dst = ip_hdr->ip_dst;
-          bzero(&(tcp_psd_hdr->reserved), 1);
-          tcp_psd_hdr->protocol = ip_protocol_tcp;
-          tcp_psd_hdr->tcp_len = tcp_len;
-
-          memcpy(psd_pkt + sizeof(sr_tcp_psd_hdr_t), tcp_hdr, 
-            (int)ntohs(ip_hdr->ip_len) - ((int)ip_hdr->ip_hl)*4);
-
-          uint16_t tcp_cksum = cksum(psd_pkt, sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-
-          tcp_hdr->tcp_sum = tcp_cksum;
-          free(psd_pkt);
+          /* if the udp is from internal to external */
+          if (strcmp(pkt->iface, EXT_INTERFACE) == 0) {
+            nat_mapping = sr_nat_udp_outbound(sr->nat, ip_hdr->ip_src, 
+              ntohs(udp_hdr->port_src));
+          }
+          /* if the udp is from external to internal */
+          if (strcmp(pkt->iface, INT_INTERFACE) == 0) {
+            nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(udp_hdr->port_dst), 
+              nat_mapping_udp, 0, 0, 0, 0, 0, 0);
+          }
+          /* out of ports or mapping expired meanwhile, drop the packet */
+          if (!nat_mapping) {
+            continue;
+          }
+          sr_nat_translate_udp(pkt->buf, nat_mapping, 
+            strcmp(pkt->iface, EXT_INTERFACE) == 0);
         }
       }
       
@@ -440,7 +696,7 @@ int sr_handle_ip_pkt(struct sr_instance* sr,
   sr_ip_hdr_t *ip_hdr;
   sr_icmp_t8_hdr_t *icmp_t8_hdr;
   sr_tcp_hdr_t *tcp_hdr;
-  struct sr_nat_mapping *nat_mapping = NULL;
+  const struct sr_nat_mapping *nat_mapping = NULL;
 
   ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
   assert(ip_hdr); 
@@ -451,6 +707,23 @@ int sr_handle_ip_pkt(struct sr_instance* sr,
     return -1;
   }
 
+  /* uRPF: drop spoofed sources before they can create NAT state or
+   * make us generate ICMP errors */
+  if (sr->urpf_mode != sr_urpf_off) {
+    const struct sr_if *rpf_iface = NULL;
+    if (sr->urpf_mode == sr_urpf_strict) {
+      rpf_iface = sr_get_interface(sr, interface);
+    }
+    if (!sr_fib_rpf_check(sr->fib, ip_hdr->ip_src, rpf_iface)) {
+      unsigned long drops = __sync_add_and_fetch(&(sr->urpf_drops), 1);
+      /* rate limited, a spoofed flood must not turn into log spam */
+      if ((drops & 0x3ff) == 1) {
+        fprintf(stderr, "** uRPF: %lu packets with unroutable source dropped\n", drops);
+      }
+      return -1;
+    }
+  }
+
   /* Look for nat mapping for corresponding dst_ip and dst_aux. */
   /* if the ip packet is an icmp packet */
   if (sr->nat_on){
@@ -458,11 +731,20 @@ int sr_handle_ip_pkt(struct sr_instance* sr,
       icmp_t8_hdr = (sr_icmp_t8_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + 
       sizeof(struct sr_ip_hdr));
       /* If the packet comes from outside. */
-      if (ip_hdr->ip_dst == sr->nat->ip_ext){
-        nat_mapping = sr_nat_lookup_external(sr->nat, icmp_t8_hdr->icmp_id, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
+      if (sr_nat_is_external(sr->nat, ip_hdr->ip_dst)){
+        nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, icmp_t8_hdr->icmp_id, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
       }
     }
 
+    /* if the ip packet is an udp packet from outside */
+    if (ip_hdr->ip_p == ip_protocol_udp && sr_nat_is_external(sr->nat, ip_hdr->ip_dst) &&
+        len >= sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl*4 + sizeof(sr_udp_hdr_t)) {
+      sr_udp_hdr_t *udp_hdr = (sr_udp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + 
+        ip_hdr->ip_hl*4);
+      nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(udp_hdr->port_dst), 
+        nat_mapping_udp, 0, 0, 0, 0, 0, 0);
+    }
+
     /* if the ip packet is a tcp packet */
     if (ip_hdr->ip_p == ip_protocol_tcp) {
       tcp_hdr = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + 
@@ -474,11 +756,11 @@ int sr_handle_ip_pkt(struct sr_instance* sr,
       int fin = flag & 1;          
 
       /* If the packet comes from outside.*/
-      if (ip_hdr->ip_dst == sr->nat->ip_ext){
+      if (sr_nat_is_external(sr->nat, ip_hdr->ip_dst)){
         if (ntohs(tcp_hdr->port_dst) < 1024){
           sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 3);
         }
-        nat_mapping = sr_nat_lookup_external(sr->nat, ntohs(tcp_hdr->port_dst), nat_mapping_tcp, 
+        nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(tcp_hdr->port_dst), nat_mapping_tcp, 
           ip_hdr->ip_src, tcp_hdr->port_src, ack, syn, fin, 0);
       }
 
@@ -524,7 +806,6 @@ int sr_handle_ip_pkt(struct sr_instance* sr,
     return -1;
   }
 
-  free(nat_mapping);
   return 0;
 } /* end sr_handle_ip_pkt */
 
@@ -535,7 +816,6 @@ int sr_handle_pkt_for_me(struct sr_instance* sr,
         unsigned int len,
         char* interface)
 {
-  sr_ethernet_hdr_t *ethernet_hdr;
   sr_ip_hdr_t *ip_hdr;
   sr_icmp_hdr_t *icmp_hdr;
   struct sr_if* iface = sr_get_interface(sr, interface);  
@@ -584,39 +864,30 @@ int sr_handle_pkt_for_me(struct sr_instance* sr,
       ip_hdr->ip_dst = ip_hdr->ip_src;
       ip_hdr->ip_src = reply_src;
       /* LPM */
-      struct sr_rt *rtable;
-      rtable = sr_longest_prefix_match(sr, ip_hdr->ip_dst);
-      if (rtable->gw.s_addr) {
-        struct sr_if *o_iface = sr_get_interface(sr, rtable->interface);
+      const struct sr_nexthop *nh;
+      nh = sr_longest_prefix_match(sr, ip_hdr->ip_dst);
+      if (nh && nh->gw.s_addr) {
+        struct sr_if *o_iface = nh->iface;
         ip_hdr->ip_p = ip_protocol_icmp;
         ip_hdr->ip_ttl = 0xff;
         bzero(&(ip_hdr->ip_sum), 2);
         uint16_t ip_cksum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
         ip_hdr->ip_sum = ip_cksum;
 
-        /* check arp cache for next hop mac */
-        struct sr_arpentry *arp_entry; 
-        arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
-        /*arp cache hit */
-        if (arp_entry) {
-          /* update ethernet header */
-          ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-          memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN); 
-          memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN);         
-
+        /* adjacency resolved: it writes the whole ethernet header */
+        if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
           /* send icmp echo reply packet */
           printf("Send packet:\n");
           print_hdrs(sr_pkt, len);
-          sr_send_packet(sr, sr_pkt, len, rtable->interface);
+          sr_send_packet(sr, sr_pkt, len, nh->interface);
         }
 
-        /* arp miss */
-        else {
-          uint8_t *arp_packet = construct_arp_buff(o_iface->addr,  o_iface->ip, rtable->gw.s_addr);
+        /* arp miss, on an interface that exists */
+        else if (o_iface) {
+          uint8_t *arp_packet = construct_arp_buff(o_iface->addr,  o_iface->ip, nh->gw.s_addr);
           sr_send_packet(sr, arp_packet, sizeof(struct sr_ethernet_hdr) + 
-            sizeof(struct sr_arp_hdr), rtable->interface);
-          sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, sr_pkt, len, rtable->interface);
+            sizeof(struct sr_arp_hdr), nh->interface);
+          sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, sr_pkt, len, nh->interface);
         }      
       }
 
@@ -721,11 +992,13 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
         unsigned int len,
         char* interface) 
 {
-  sr_ethernet_hdr_t *ethernet_hdr;
   sr_ip_hdr_t * ip_hdr;  
 
   ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
   assert(ip_hdr);
+
+  /* keeps every packet of a flow on the same equal cost next hop */
+  uint32_t flow = flow_hash((uint8_t *)ip_hdr, len - sizeof(struct sr_ethernet_hdr));
     
   /* Routing with NAT. */
   if (sr->nat_on == 1) {
@@ -751,10 +1024,10 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       if (original_icmp_hdr->icmp_type == 8) {        
 	
       	/* lookup the longest prefix match */
-      	struct sr_rt *rtable = sr_longest_prefix_match(sr, original_ip_dst);
+      	const struct sr_nexthop *nh = sr_longest_prefix_match_flow(sr, original_ip_dst, flow);
 
       	/* if no match, icmp net unreachable */
-      	if (! rtable->gw.s_addr) {
+      	if (!nh || !nh->gw.s_addr) {
       	  sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
       	  return;
       	}
@@ -763,7 +1036,7 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	else {
       	  
       	  /* Look for nat mapping for corresponding src_ip and src_aux. */
-      	  struct sr_nat_mapping *nat_mapping;
+      	  const struct sr_nat_mapping *nat_mapping;
       	  nat_mapping = sr_nat_lookup_internal(sr->nat, original_ip_src, 
             *original_icmp_id, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
 	  
@@ -771,26 +1044,19 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	  if (!nat_mapping) {
       	    nat_mapping = sr_nat_insert_mapping(sr->nat, original_ip_src, 
       					*original_icmp_id, nat_mapping_icmp, 0, 0);
+      	    /* out of external ids, drop the packet */
+      	    if (!nat_mapping) {
+      	      return;
+      	    }
       	  }
       	  
-      	  struct sr_if* o_iface = sr_get_interface(sr, EXT_INTERFACE);
-      	  assert(o_iface);
 
       	  /* make a copy of the packet */
       	  uint8_t *sr_pkt = (uint8_t *)malloc(len);
       	  memcpy(sr_pkt, packet, len);
 
-      	  /* check arp cache for next hop mac */
-      	  struct sr_arpentry *arp_entry; 
-      	  arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
-      	  /*arp cache hit */
-      	  if (arp_entry) {
-      	    /* update ethernet header */
-      	    ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-      	    memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN); 
-      	    memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN); 
-      	  
+      	  /* adjacency resolved: it writes the whole ethernet header */
+      	  if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
       	    /* update ip header */
       	    ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
       	    ip_hdr->ip_ttl--;
@@ -803,33 +1069,29 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	    sr_icmp_t8_hdr_t *icmp_hdr_new;
       	    icmp_hdr_new = (sr_icmp_t8_hdr_t *)(sr_pkt + 
       	      sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+      	    icmp_hdr_new->icmp_sum = cksum_adjust16(icmp_hdr_new->icmp_sum,
+      	      icmp_hdr_new->icmp_id, nat_mapping->aux_ext);
       	    icmp_hdr_new->icmp_id = nat_mapping->aux_ext;
-      	    bzero(&(icmp_hdr_new->icmp_sum), 2);
-      	    uint16_t icmp_cksum = cksum(icmp_hdr_new, (int)ntohs(ip_hdr->ip_len)-((int)ip_hdr->ip_hl)*4);
-      	    icmp_hdr_new->icmp_sum = icmp_cksum;
 
       	    /* send frame to next hop */
       	    printf("Send packet with NAT:\n");
       	    print_hdrs(sr_pkt, len);
-      	    sr_send_packet(sr, sr_pkt, len, rtable->interface);
-      	    free(arp_entry);
+      	    sr_send_packet(sr, sr_pkt, len, nh->interface);
       	  }    
       	  /* arp miss */
       	  else {
-      	    sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, 
-      				 rtable->interface);
+      	    sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, 
+      				 nh->interface);
       	  }
       	  free(sr_pkt);
-      	  free(rtable); 
-          free(nat_mapping);
       	}
       }
 
       /* If it's an ICMP echo reply*/
       else if (original_icmp_hdr->icmp_type == 0) {
       	/* Look for nat mapping for corresponding dst_ip and dst_aux. */
-      	struct sr_nat_mapping *nat_mapping;
-      	nat_mapping = sr_nat_lookup_external(sr->nat, *original_icmp_id, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
+      	const struct sr_nat_mapping *nat_mapping;
+      	nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, *original_icmp_id, nat_mapping_icmp, 0, 0, 0, 0, 0, 0);
       	
       	if (!nat_mapping) {
       	  fprintf(stderr , "** Error: No mapping found when forwarding icmp reply.");
@@ -837,33 +1099,22 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	}
 	
 	      /* lookup the longest prefix match */
-      	struct sr_rt *rtable = sr_longest_prefix_match(sr, nat_mapping->ip_int);
+      	const struct sr_nexthop *nh = sr_longest_prefix_match_flow(sr, nat_mapping->ip_int, flow);
 
       	/* if no match, icmp net unreachable */
-      	if (! rtable->gw.s_addr) {
+      	if (!nh || !nh->gw.s_addr) {
       	  sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
       	  return;
       	}
       	/* match */
       	else {
-	        struct sr_if* o_iface = sr_get_interface(sr, INT_INTERFACE);
-      	  assert(o_iface);
 
       	  /* make a copy of the packet */
       	  uint8_t *sr_pkt = (uint8_t *)malloc(len);
       	  memcpy(sr_pkt, packet, len);
 
-      	  /* check arp cache for next hop mac */
-      	  struct sr_arpentry *arp_entry; 
-      	  arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
-      	  /*arp cache hit */
-      	  if (arp_entry) {
-      	    /* update ethernet header */
-      	    ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-      	    memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN); 
-      	    memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN); 
-      	  
+      	  /* adjacency resolved: it writes the whole ethernet header */
+      	  if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
       	    /* update ip header */
       	    ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
       	    ip_hdr->ip_ttl--;
@@ -876,25 +1127,21 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	    sr_icmp_t8_hdr_t *icmp_hdr_new;
       	    icmp_hdr_new = (sr_icmp_t8_hdr_t *)(sr_pkt + 
       	      sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+      	    icmp_hdr_new->icmp_sum = cksum_adjust16(icmp_hdr_new->icmp_sum,
+      	      icmp_hdr_new->icmp_id, nat_mapping->aux_int);
       	    icmp_hdr_new->icmp_id = nat_mapping->aux_int;
-      	    bzero(&(icmp_hdr_new->icmp_sum), 2);
-      	    uint16_t icmp_cksum = cksum(icmp_hdr_new, (int)ntohs(ip_hdr->ip_len)-((int)ip_hdr->ip_hl)*4);
-      	    icmp_hdr_new->icmp_sum = icmp_cksum;
 
       	    /* send frame to next hop */
       	    printf("Send packet with NAT:\n");
       	    print_hdrs(sr_pkt, len);
-      	    sr_send_packet(sr, sr_pkt, len, rtable->interface);
-      	    free(arp_entry);
+      	    sr_send_packet(sr, sr_pkt, len, nh->interface);
       	  }    
       	  /* arp miss */
       	  else {
-      	    sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, 
-      				 rtable->interface);
+      	    sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, 
+      				 nh->interface);
       	  }
       	  free(sr_pkt);
-      	  free(rtable);
-          free(nat_mapping);
 	      }
       }
     }
@@ -927,19 +1174,19 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
         printf("3\n");
 
         /* lookup the longest prefix match */
-        struct sr_rt *rtable = sr_longest_prefix_match(sr, original_ip_dst);
+        const struct sr_nexthop *nh = sr_longest_prefix_match_flow(sr, original_ip_dst, flow);
 
         printf("4\n");
 
         /* if no match, icmp net unreachable */
-        if (! rtable->gw.s_addr) {
+        if (!nh || !nh->gw.s_addr) {
           sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
           return;
         }
 
         /* if match */          
         /* Look for nat mapping for corresponding src_ip and src_aux. */
-        struct sr_nat_mapping *nat_mapping;
+        const struct sr_nat_mapping *nat_mapping;
         nat_mapping = sr_nat_lookup_internal(sr->nat, original_ip_src, 
           ntohs(original_tcp_src_port), nat_mapping_tcp, ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin, 1);
         
@@ -949,10 +1196,12 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
         if (!nat_mapping) {
           nat_mapping = sr_nat_insert_mapping(sr->nat, original_ip_src, 
             ntohs(original_tcp_src_port), nat_mapping_tcp, ip_hdr->ip_dst, tcp_hdr->port_dst);
+          /* out of external ports, drop the packet */
+          if (!nat_mapping) {
+            return;
+          }
         }
         
-        struct sr_if* o_iface = sr_get_interface(sr, EXT_INTERFACE);
-        assert(o_iface);
 
         /* make a copy of the packet */
         uint8_t *sr_pkt = (uint8_t *)malloc(len);
@@ -961,20 +1210,14 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
 
         printf("6\n");
 
-        /* check arp cache for next hop mac */
-        struct sr_arpentry *arp_entry; 
-        arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
-        /*arp cache hit */
-        if (arp_entry) {
-          /* update ethernet header */
-          ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-          memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN); 
-          memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN); 
-
+        /* adjacency resolved: it writes the whole ethernet header */
+        if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
           /* update ip header */
           ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
           ip_hdr->ip_ttl--;
+          /* the address is part of the tcp pseudo header */
+          tcp_hdr->tcp_sum = cksum_adjust32(tcp_hdr->tcp_sum,
+            ip_hdr->ip_src, nat_mapping->ip_ext);
           ip_hdr->ip_src = nat_mapping->ip_ext;
           bzero(&(ip_hdr->ip_sum), 2);  
           uint16_t ip_cksum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
@@ -984,85 +1227,56 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
 
           /* update tcp header */          
           printf("UPDATE TCP PORT TO %d...................\n", nat_mapping->aux_ext);
+          tcp_hdr->tcp_sum = cksum_adjust16(tcp_hdr->tcp_sum,
+            tcp_hdr->port_src, htons(nat_mapping->aux_ext));
           tcp_hdr->port_src = htons(nat_mapping->aux_ext);
-          /* recalculate tcp chechsum */
-          bzero(&(tcp_hdr->tcp_sum), 2);
-
-          /*
-          uint16_t tcp_cksum = cksum(tcp_hdr, len - 
-            sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-          tcp_hdr->tcp_sum = tcp_cksum;
-          */
-
-          /* create a pseudo tcp packet for computing tcp check sum */
-          sr_tcp_psd_hdr_t *tcp_psd_hdr;
-          int tcp_len = (int)ntohs(ip_hdr->ip_len) - (int)ip_hdr->ip_hl * 4;
-          uint8_t *psd_pkt = (uint8_t *)malloc(sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-          tcp_psd_hdr = (sr_tcp_psd_hdr_t *)psd_pkt;
-          tcp_psd_hdr->ip_src = ip_hdr->ip_src;
-          tcp_psd_hdr->ip_dst = ip_hdr->ip_dst;
-          bzero(&(tcp_psd_hdr->reserved), 1);
-          tcp_psd_hdr->protocol = ip_protocol_tcp;
-          tcp_psd_hdr->tcp_len = tcp_len;
-
-          memcpy(psd_pkt + sizeof(sr_tcp_psd_hdr_t), tcp_hdr, tcp_len);
-
-          uint16_t tcp_cksum = cksum(psd_pkt, sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-
-          tcp_hdr->tcp_sum = tcp_cksum; 
-          
           
           /* send frame to next hop */
           printf("Send packet:\n");
           print_hdrs(sr_pkt, len);
-          sr_send_packet(sr, sr_pkt, len, EXT_INTERFACE);
+          sr_send_packet(sr, sr_pkt, len, nh->interface);
           printf("9\n");
-          free(arp_entry);
-          free(psd_pkt);
 
         }
         /* arp miss */
         else {
-          sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, 
-             EXT_INTERFACE);
+          sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, 
+             nh->interface);
         }
         free(sr_pkt);
-        free(rtable); 
-        free(nat_mapping);
       }
 
       /* if the tcp is from external to internal */
       if (strcmp(interface, EXT_INTERFACE) == 0) {
 
         /* Look for nat mapping for corresponding dst_ip and dst_aux. */
-        struct sr_nat_mapping *nat_mapping;
-        nat_mapping = sr_nat_lookup_external(sr->nat, ntohs(original_tcp_dst_port), 
+        const struct sr_nat_mapping *nat_mapping;
+        nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(original_tcp_dst_port), 
           nat_mapping_tcp, ip_hdr->ip_src, tcp_hdr->port_src, ack, syn, fin, 1);
         
         printf("12\n");
 
         /* if no mapping, drop the packet */
         if (!nat_mapping) {
-          sleep(6);
-          nat_mapping = sr_nat_lookup_external(sr->nat, ntohs(original_tcp_dst_port), 
-          nat_mapping_tcp, ip_hdr->ip_src, tcp_hdr->port_src, ack, syn, fin, 1);
-          if (!nat_mapping){
-            if (ntohs(original_tcp_dst_port) >= 1024){
-              sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 3);
-              return;
-            }
-            else{
-              fprintf(stderr , "** Error: packet from port less than 1024. \n");
-              return;
-            } 
+          if (ntohs(original_tcp_dst_port) < 1024){
+            fprintf(stderr , "** Error: packet from port less than 1024. \n");
+            return;
           }
+          /* an unsolicited syn may be half of a simultaneous open, hold
+             it and let sr_syn_pending_sweep decide */
+          if (syn && !ack){
+            sr_syn_pending_add(sr, packet, len, interface);
+            return;
+          }
+          sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 3);
+          return;
         }
 
         /* lookup the longest prefix match */
-        struct sr_rt *rtable = sr_longest_prefix_match(sr, nat_mapping->ip_int);
+        const struct sr_nexthop *nh = sr_longest_prefix_match_flow(sr, nat_mapping->ip_int, flow);
 
         /* if no match, icmp net unreachable */
-        if (! rtable->gw.s_addr) {
+        if (!nh || !nh->gw.s_addr) {
           sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
           return;
         }
@@ -1070,34 +1284,24 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
         printf("13\n");
 
         /* match */        
-        struct sr_if* o_iface = sr_get_interface(sr, INT_INTERFACE);
-        assert(o_iface);
 
         /* make a copy of the packet */
         uint8_t *sr_pkt = (uint8_t *)malloc(len);
         memcpy(sr_pkt, packet, len);
         tcp_hdr = (sr_tcp_hdr_t *)(sr_pkt + sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl*4);
 
-        /* check arp cache for next hop mac */
-        struct sr_arpentry *arp_entry; 
-        arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
         printf("14\n");
 
-        /*arp cache hit */
-        if (arp_entry) {
-          /* update ethernet header */
-          ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-          memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
-          printf("14.1\n");
-          memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN);
-          printf("14.2\n");
-        
+        /* adjacency resolved: it writes the whole ethernet header */
+        if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
           /* update ip header */
           ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
           printf("14.3\n");
           ip_hdr->ip_ttl--;
           printf("14.4\n");
+          /* the address is part of the tcp pseudo header */
+          tcp_hdr->tcp_sum = cksum_adjust32(tcp_hdr->tcp_sum,
+            ip_hdr->ip_dst, nat_mapping->ip_int);
           ip_hdr->ip_dst = nat_mapping->ip_int;
           printf("14.5\n");
           bzero(&(ip_hdr->ip_sum), 2);
@@ -1109,56 +1313,94 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
           printf("15\n");
 
           /* update tcp header */          
+          tcp_hdr->tcp_sum = cksum_adjust16(tcp_hdr->tcp_sum,
+            tcp_hdr->port_dst, htons(nat_mapping->aux_int));
           tcp_hdr->port_dst = htons(nat_mapping->aux_int); 
-          /* recalculate tcp chechsum */
-          bzero(&(tcp_hdr->tcp_sum), 2);
-
-          /*
-          uint16_t tcp_cksum = cksum(tcp_hdr, len - 
-            sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-          tcp_hdr->tcp_sum = tcp_cksum;
-          */
-
-          /* create a pseudo tcp packet for computing tcp check sum */
-          sr_tcp_psd_hdr_t *tcp_psd_hdr;
-          int tcp_len = (int)ntohs(ip_hdr->ip_len) - (int)ip_hdr->ip_hl * 4;
-          uint8_t *psd_pkt = (uint8_t *)malloc(sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-          tcp_psd_hdr = (sr_tcp_psd_hdr_t *)psd_pkt;
-          tcp_psd_hdr->ip_src = ip_hdr->ip_src;
-          tcp_psd_hdr->ip_dst = ip_hdr->ip_dst;
-          bzero(&(tcp_psd_hdr->reserved), 1);
-          tcp_psd_hdr->protocol = ip_protocol_tcp;
-          tcp_psd_hdr->tcp_len = tcp_len;
-
-          memcpy(psd_pkt + sizeof(sr_tcp_psd_hdr_t), tcp_hdr, tcp_len);
-
-          uint16_t tcp_cksum = cksum(psd_pkt, sizeof(sr_tcp_psd_hdr_t) + tcp_len);
-
-          tcp_hdr->tcp_sum = tcp_cksum;
-          
           
           /* send frame to next hop */
           printf("16\n");
           printf("Send packet:\n");
           print_hdrs(sr_pkt, len);
-          sr_send_packet(sr, sr_pkt, len, INT_INTERFACE);
-          free(arp_entry);
-          free(psd_pkt);
+          sr_send_packet(sr, sr_pkt, len, nh->interface);
         }  
         /* arp miss */
         else {
           printf("14.0001\n");
-          sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, 
-             INT_INTERFACE);
+          sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, 
+             nh->interface);
           printf("14.0002\n");
         }
         printf("17\n");
         free(sr_pkt);
-        free(rtable);
-        free(nat_mapping);
         printf("18\n");
       }
     }
+
+    /* If it's an UDP packet*/
+    else if (ip_hdr->ip_p == ip_protocol_udp) {
+
+      if (len < sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl*4 + sizeof(sr_udp_hdr_t)) {
+        fprintf(stderr , "** Error: udp packet is way too short \n");
+        return;
+      }
+
+      sr_udp_hdr_t *udp_hdr;
+      udp_hdr = (sr_udp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl*4);
+      const struct sr_nat_mapping *nat_mapping;
+      const struct sr_nexthop *nh;
+      int outbound = (strcmp(interface, INT_INTERFACE) == 0);
+
+      /* if the udp is from internal to external */
+      if (outbound) {
+        /* lookup the longest prefix match */
+        nh = sr_longest_prefix_match_flow(sr, original_ip_dst, flow);
+        if (!nh || !nh->gw.s_addr) {
+          sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
+          return;
+        }
+        nat_mapping = sr_nat_udp_outbound(sr->nat, original_ip_src, ntohs(udp_hdr->port_src));
+        /* out of external ports, drop the packet */
+        if (!nat_mapping) {
+          return;
+        }
+      }
+
+      /* if the udp is from external to internal */
+      else {
+        nat_mapping = sr_nat_lookup_external(sr->nat, ip_hdr->ip_dst, ntohs(udp_hdr->port_dst), 
+          nat_mapping_udp, 0, 0, 0, 0, 0, 0);
+        /* if no mapping, icmp port unreachable */
+        if (!nat_mapping) {
+          sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 3);
+          return;
+        }
+        nh = sr_longest_prefix_match_flow(sr, nat_mapping->ip_int, flow);
+        if (!nh || !nh->gw.s_addr) {
+          sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
+          return;
+        }
+      }
+
+      /* make a copy of the packet */
+      uint8_t *sr_pkt = (uint8_t *)malloc(len);
+      memcpy(sr_pkt, packet, len);
+
+      /* adjacency resolved: it writes the whole ethernet header */
+      if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
+        ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
+        ip_hdr->ip_ttl--;
+        sr_nat_translate_udp(sr_pkt, nat_mapping, outbound);
+        bzero(&(ip_hdr->ip_sum), 2);
+        ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+        sr_send_packet(sr, sr_pkt, len, nh->interface);
+      }
+      /* arp miss: queued as is, translated when the reply comes in */
+      else {
+        sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, 
+           nh->interface);
+      }
+      free(sr_pkt);
+    }
   }
  
   /* Routing without NAT. */
@@ -1167,33 +1409,21 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
     ip_dest = ip_hdr->ip_dst;
     
     /* lookup the longest prefix match */
-    struct sr_rt *rtable = sr_longest_prefix_match(sr, ip_dest);
+    const struct sr_nexthop *nh = sr_longest_prefix_match_flow(sr, ip_dest, flow);
 
     /* if no match, icmp net unreachable */
-    if (! rtable->gw.s_addr) {
+    if (!nh || !nh->gw.s_addr) {
       sr_icmp_dest_unreachable(sr, packet, len, interface, 3, 0);
       return;
     }
     /* match */
     else {   
-      struct sr_if* o_iface = sr_get_interface(sr, rtable->interface);
-      assert(o_iface);
-
       /* make a copy of the packet */
       uint8_t *sr_pkt = (uint8_t *)malloc(len);
       memcpy(sr_pkt, packet, len);
 
-      /* check arp cache for next hop mac */
-      struct sr_arpentry *arp_entry; 
-      arp_entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
-
-      /*arp cache hit */
-      if (arp_entry) {
-      	/* update ethernet header */
-      	ethernet_hdr = (sr_ethernet_hdr_t *)sr_pkt;
-      	memcpy(ethernet_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN); 
-      	memcpy(ethernet_hdr->ether_shost, o_iface->addr, ETHER_ADDR_LEN); 
-            
+      /* adjacency resolved: it writes the whole ethernet header */
+      if (sr_adj_write_hdr(nh->adj, sr_pkt)) {
       	/* update ip header */
       	ip_hdr = (sr_ip_hdr_t *)(sr_pkt + sizeof(struct sr_ethernet_hdr));
       	ip_hdr->ip_ttl--;
@@ -1204,39 +1434,38 @@ void sr_forward_ip_pkt(struct sr_instance* sr,
       	/* send frame to next hop */
       	printf("Send packet:\n");
       	print_hdrs(sr_pkt, len);
-      	sr_send_packet(sr, sr_pkt, len, rtable->interface);
-      	free(arp_entry);
+      	sr_send_packet(sr, sr_pkt, len, nh->interface);
       }    
       /* arp miss */
       else {
-        sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, rtable->interface);
+        sr_arpcache_queuereq(&(sr->cache), nh->gw.s_addr, packet, len, nh->interface);
       }
       free(sr_pkt);
-      free(rtable);
     }
   }
 
   return;
 } /* end sr_forward_ip_pkt */
 
-/* Longest prefix match */
-struct sr_rt *sr_longest_prefix_match(struct sr_instance* sr, uint32_t ip)
+/* Longest prefix match, returns a read-only next-hop handle owned by the
+ * FIB (nothing to free), or NULL if no route matches */
+const struct sr_nexthop *sr_longest_prefix_match(struct sr_instance* sr, uint32_t ip)
 {
   assert(sr);
   assert(ip);
-  struct sr_rt *rtable = (struct sr_rt *)malloc(sizeof(struct sr_rt));
-  rtable->gw.s_addr = 0;
-  rtable->mask.s_addr = 0;
-
-  struct sr_rt *rt;
-  for (rt = sr->routing_table; rt != NULL; rt = rt->next) {
-    if (((ip & rt->mask.s_addr) == rt->dest.s_addr) && 
-        (rt->mask.s_addr >= rtable->mask.s_addr)) {
-      memcpy(rtable, rt, sizeof(struct sr_rt));      
-    }
-  }
 
-  return rtable;
+  return sr_fib_lookup(sr->fib, ip);
 } /* end sr_longest_prefix_match */
 
+/* Same, but spreads flows over the next hops of a multipath route by
+ * their flow_hash() */
+const struct sr_nexthop *sr_longest_prefix_match_flow(struct sr_instance* sr,
+        uint32_t ip, uint32_t flow)
+{
+  assert(sr);
+  assert(ip);
+
+  return sr_fib_lookup_flow(sr->fib, ip, flow);
+} /* end sr_longest_prefix_match_flow */
+
 
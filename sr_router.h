@@ -16,6 +16,7 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
+#include "sr_epoch.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -33,9 +34,30 @@
 #define INT_INTERFACE "eth1"
 #define EXT_INTERFACE "eth2"
 
+/* unsolicited inbound tcp syns held by the NAT, see sr_syn_pending_add */
+#define SR_SYN_PENDING_MAX 64
+#define SR_SYN_PENDING_TO  6  /* seconds */
+
+struct sr_syn_pending {
+  uint8_t *buf;               /* copy of the ethernet frame */
+  unsigned int len;
+  char iface[sr_IFACE_NAMELEN]; /* interface it arrived on */
+  time_t arrived;
+  struct sr_syn_pending *next;
+};
+
+/* reverse path check on the source of arriving packets (-U) */
+enum sr_urpf_mode {
+  sr_urpf_off,
+  sr_urpf_loose,   /* source must be routable */
+  sr_urpf_strict   /* ... and routed back out the arrival interface */
+};
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_nexthop;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -54,17 +76,26 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
+    struct sr_fib* fib; /* compiled from routing_table for lookups */
+    int fib_engine; /* enum sr_fib_engine used to compile fib */
+    struct sr_epoch fib_epoch; /* readers of fib, see sr_rt_publish */
+    const char* rtable_file; /* reloaded on SIGHUP */
+    int urpf_mode; /* enum sr_urpf_mode */
+    volatile unsigned long urpf_drops; /* packets failing the uRPF check */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
     FILE* logfile;
     /* the below added for NAT */
     struct sr_nat *nat;
     int nat_on;  /* nat_on = 1 nat enable; 0 not */
+    int nat_restore; /* reload nat->snapshot_file in sr_nat_start */
+    struct sr_syn_pending *syn_pending; /* oldest first */
+    struct sr_syn_pending *syn_pending_tail;
+    unsigned int syn_npending;
+    volatile unsigned long syn_drops; /* syns dropped, queue full or no memory */
+    pthread_mutex_t syn_lock;
 };
 
-/* -- sr_main.c -- */
-int sr_verify_routing_table(struct sr_instance* sr);
-
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
@@ -72,9 +103,11 @@ int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
+void* sr_signal_thread(void* );
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
 
 
+int sr_arp_target_is_mine(struct sr_instance* , uint32_t , char* );
 int sr_handle_arp_pkt(struct sr_instance* , uint8_t * , unsigned int , char* );
 void sr_handle_arp_request(struct sr_instance* , uint8_t * , unsigned int , char* );
 void sr_handle_arp_reply(struct sr_instance* , uint8_t * , unsigned int , char* );
@@ -82,7 +115,11 @@ int sr_handle_ip_pkt(struct sr_instance* , uint8_t * , unsigned int , char* );
 int sr_handle_pkt_for_me(struct sr_instance* , uint8_t * , unsigned int , char* );
 void sr_icmp_dest_unreachable(struct sr_instance* , uint8_t * , unsigned int , char* , uint8_t, uint8_t );
 void sr_forward_ip_pkt(struct sr_instance* , uint8_t * , unsigned int , char* );
-struct sr_rt *sr_longest_prefix_match(struct sr_instance*, uint32_t);
+void sr_syn_pending_add(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_syn_pending_sweep(struct sr_instance* );
+int sr_nat_start(struct sr_instance* );
+const struct sr_nexthop *sr_longest_prefix_match(struct sr_instance*, uint32_t);
+const struct sr_nexthop *sr_longest_prefix_match_flow(struct sr_instance*, uint32_t, uint32_t);
 
 
 
@@ -20,10 +20,190 @@
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_append
+ * Scope:  Local
+ *
+ * Append an entry at *tail and advance tail to the new entry's next
+ * link, so building an N entry list costs O(N).
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_append(struct sr_rt*** tail, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, const char* if_name)
+{
+    struct sr_rt* entry;
+
+    entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    assert(entry);
+    entry->next = 0;
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
+
+    **tail = entry;
+    *tail = &(entry->next);
+} /* -- sr_rt_append -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_ip
+ * Scope:  Local
+ *
+ * Parse a dotted quad at *pp (leading blanks skipped) into addr and
+ * advance *pp past it.  Returns 0 if the text is not a dotted quad
+ * followed by a blank or the end of the line.  Much cheaper than
+ * sscanf + inet_aton when loading very large tables.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_parse_ip(const char** pp, struct in_addr* addr)
+{
+    const char* p = *pp;
+    uint32_t ip = 0;
+    int octet;
+
+    while(*p == ' ' || *p == '\t')
+    { p++; }
+
+    for(octet = 0; octet < 4; octet++)
+    {
+        unsigned int val = 0;
+        const char* start = p;
+
+        while(*p >= '0' && *p <= '9' && p - start < 3)
+        { val = val * 10 + (*p++ - '0'); }
+        if(p == start || val > 255)
+        { return 0; }
+        if(octet < 3 && *p++ != '.')
+        { return 0; }
+        ip = (ip << 8) | val;
+    }
+
+    if(*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && *p != 0)
+    { return 0; }
+
+    addr->s_addr = htonl(ip);
+    *pp = p;
+    return 1;
+} /* -- sr_rt_parse_ip -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_word
+ * Scope:  Local
+ *
+ * Copy the next blank separated word at *pp into buf (at most len-1
+ * characters) and advance *pp past it.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_parse_word(const char** pp, char* buf, int len)
+{
+    const char* p = *pp;
+    int n = 0;
+
+    while(*p == ' ' || *p == '\t')
+    { p++; }
+    while(*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+    {
+        if(n < len - 1)
+        { buf[n++] = *p; }
+        p++;
+    }
+    buf[n] = 0;
+    *pp = p;
+} /* -- sr_rt_parse_word -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_free_list
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_free_list(struct sr_rt* list)
+{
+    while(list)
+    {
+        struct sr_rt* next = list->next;
+        free(list);
+        list = next;
+    }
+} /* -- sr_rt_free_list -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_publish_fib
+ * Scope:  Global
+ *
+ * Make list and its compiled fib live (list may be 0 for a FIB loaded
+ * from an image).  The FIB pointer is swapped atomically, so packets
+ * being forwarded keep using the old version until they are done with
+ * it; the old list and FIB are only freed once sr_epoch_synchronize
+ * says no lookup can still hold them.
+ *
+ * Once the interfaces are known, a table with a next hop on an
+ * interface that does not exist is refused: list and fib are freed,
+ * the current table stays and -1 is returned.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_publish_fib(struct sr_instance* sr, struct sr_rt* list,
+                      struct sr_fib* fib)
+{
+    struct sr_fib* old_fib;
+    struct sr_rt*  old_list;
+    int32_t i;
+
+    sr_fib_bind_interfaces(fib, sr->if_list);
+    for(i = 0; sr->if_list && i < fib->nnexthops; i++)
+    {
+        if(fib->nexthops[i].iface == 0)
+        {
+            fprintf(stderr,"Routing table uses unknown interface %s\n",
+                    fib->nexthops[i].interface);
+            sr_fib_destroy(fib);
+            sr_rt_free_list(list);
+            return -1;
+        }
+    }
+    sr_arpcache_bind_fib(&(sr->cache), fib);
+
+    old_list = sr->routing_table;
+    sr->routing_table = list;
+    old_fib = __sync_lock_test_and_set(&(sr->fib), fib);
+    __sync_synchronize();
+
+    sr_epoch_synchronize(&(sr->fib_epoch));
+    sr_fib_destroy(old_fib);
+    sr_rt_free_list(old_list);
+
+    return 0;
+} /* -- sr_rt_publish_fib -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_publish
+ * Scope:  Global
+ *
+ * Compile list with the configured engine and publish it.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_publish(struct sr_instance* sr, struct sr_rt* list)
+{
+    return sr_rt_publish_fib(sr, list, sr_fib_build(list, sr->fib_engine));
+} /* -- sr_rt_publish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt
+ * Scope:  Global
+ *
+ * Parse a routing table file into a new list off to the side and
+ * publish it.  On a parse error, or a route on an unknown interface,
+ * the current table stays in place; an empty file also leaves the
+ * current table alone.
  *
  *---------------------------------------------------------------------*/
 
@@ -31,14 +211,14 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
 {
     FILE* fp;
     char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
+    char  iface[sr_IFACE_NAMELEN];
+    const char* p;
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt* list = 0;
+    struct sr_rt** tail = &list;
+    struct sr_fib* fib;
 
     /* -- REQUIRES -- */
     assert(filename);
@@ -48,41 +228,60 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
         return -1;
     }
 
+    /* -- precompiled binary FIB, no text to parse -- */
+    if(sr_fib_is_image(filename))
+    {
+        if((fib = sr_fib_load_image(filename)) == 0)
+        { return -1; }
+        printf("Loading routing table from FIB image %s (%d routes).\n",
+               filename, fib->nroutes);
+        return sr_rt_publish_fib(sr, 0, fib);
+    }
+
     fp = fopen(filename,"r");
+    if(fp == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    setvbuf(fp, 0, _IOFBF, 1 << 20);
 
     while( fgets(line,BUFSIZ,fp) != 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
-        }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
-        }
-        if(inet_aton(mask,&mask_addr) == 0)
+        p = line;
+        while(*p == ' ' || *p == '\t')
+        { p++; }
+        if(*p == '\n' || *p == '\r' || *p == '#' || *p == 0)
+        { continue; }
+
+        if(!sr_rt_parse_ip(&p,&dest_addr) ||
+           !sr_rt_parse_ip(&p,&gw_addr) ||
+           !sr_rt_parse_ip(&p,&mask_addr))
         { 
             fprintf(stderr,
                     "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+                    p);
+            goto fail;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
-        }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
+        sr_rt_parse_word(&p,iface,sr_IFACE_NAMELEN);
+        sr_rt_append(&tail,dest_addr,gw_addr,mask_addr,iface);
     } /* -- while -- */
 
+    fclose(fp);
+
+    if(list)
+    {
+        printf("Loading routing table from server, clear local routing table.\n");
+        return sr_rt_publish(sr, list);
+    }
+
     return 0; /* -- success -- */
+
+fail:
+    fclose(fp);
+    sr_rt_free_list(list);
+    return -1;
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
@@ -93,43 +292,67 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
 void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt** tail = &(sr->routing_table);
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
-    {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+    while(*tail)
+    { tail = &((*tail)->next); }
+    sr_rt_append(&tail,dest,gw,mask,if_name);
 
-        return;
-    }
+} /* -- sr_add_entry -- */
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
-    }
+/*---------------------------------------------------------------------
+ * Method: sr_verify_routing_table()
+ * Scope: Global
+ *
+ * make sure the routing table is consistent with the interface list by
+ * verifying that all interfaces used in the routing table actually exist
+ * in the hardware.  Works from the compiled FIB so that tables loaded from
+ * a binary image (which have no sr_rt list) are checked too.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  something other than zero on error
+ *
+ *---------------------------------------------------------------------*/
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    struct sr_if* if_walker = 0;
+    int ret = 0;
+    int32_t i;
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    /* -- REQUIRES --*/
+    assert(sr);
 
-} /* -- sr_add_entry -- */
+    if( (sr->if_list == 0) || (sr->fib == 0) || (sr->fib->nroutes == 0))
+    {
+        return 999; /* doh! */
+    }
+
+    /* -- every route uses one of the FIB's next hops, so checking the
+          (much shorter) next hop table covers the whole table -- */
+    for(i = 0; i < sr->fib->nnexthops; i++)
+    {
+        /* -- check to see if interface exists -- */
+        if_walker = sr->if_list;
+        while(if_walker)
+        {
+            if( strncmp(if_walker->name,sr->fib->nexthops[i].interface,
+                        sr_IFACE_NAMELEN) == 0)
+            { break; }
+            if_walker = if_walker->next;
+        }
+        if(if_walker == 0)
+        { ret++; } /* -- interface not found! -- */
+    } /* -- for -- */
+
+    return ret;
+} /* -- sr_verify_routing_table -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -142,6 +365,12 @@ void sr_print_routing_table(struct sr_instance* sr)
 
     if(sr->routing_table == 0)
     {
+        if(sr->fib && sr->fib->nroutes)
+        {
+            printf(" %d routes (%s) loaded from FIB image\n",
+                   sr->fib->nroutes, sr_fib_engine_name(sr->fib->engine));
+            return;
+        }
         printf(" *warning* Routing table empty \n");
         return;
     }
@@ -38,8 +38,12 @@ struct sr_rt
 
 
 int sr_load_rt(struct sr_instance*,const char*);
+struct sr_fib;
+int sr_rt_publish(struct sr_instance*, struct sr_rt*);
+int sr_rt_publish_fib(struct sr_instance*, struct sr_rt*, struct sr_fib*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+int sr_verify_routing_table(struct sr_instance* sr);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
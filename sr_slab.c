@@ -0,0 +1,156 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.c
+ *
+ * Description:
+ *
+ * Fixed size object pools backed by large chunks.  See sr_slab.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sr_slab.h"
+
+/* objects are aligned like the strictest of these */
+union sr_slab_align
+{
+    void*  p;
+    long   l;
+    double d;
+};
+
+struct sr_slab_chunk
+{
+    struct sr_slab_chunk* next;
+    union sr_slab_align   pad;  /* objects follow, suitably aligned */
+};
+
+#define SLAB_ALIGN sizeof(union sr_slab_align)
+
+void sr_slab_init(struct sr_slab* slab, size_t size, unsigned long grow)
+{
+    if(size < sizeof(void*))
+    { size = sizeof(void*); }
+    slab->size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    slab->grow = grow ? grow : 1;
+    slab->free_list = 0;
+    slab->chunks = 0;
+    slab->in_use = 0;
+    slab->capacity = 0;
+    slab->peak = 0;
+    slab->grows = 0;
+} /* -- sr_slab_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_slab_add_chunk
+ * Scope:  Local
+ *
+ * Allocate room for n more objects and put them all on the free list.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_slab_add_chunk(struct sr_slab* slab, unsigned long n)
+{
+    struct sr_slab_chunk* chunk;
+    char* obj;
+    unsigned long i;
+
+    chunk = (struct sr_slab_chunk*)malloc(sizeof(struct sr_slab_chunk)
+                                          + n * slab->size);
+    if(!chunk)
+    { return -1; }
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    /* thread back to front so objects come out in address order */
+    obj = (char*)(chunk + 1) + (n - 1) * slab->size;
+    for(i = 0; i < n; i++, obj -= slab->size)
+    {
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->capacity += n;
+
+    return 0;
+} /* -- sr_slab_add_chunk -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_slab_reserve
+ * Scope:  Global
+ *
+ * Make sure the pool holds at least n objects without growing again.
+ * Returns 0 on success, -1 if memory could not be allocated.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_slab_reserve(struct sr_slab* slab, unsigned long n)
+{
+    if(n <= slab->capacity)
+    { return 0; }
+    return sr_slab_add_chunk(slab, n - slab->capacity);
+} /* -- sr_slab_reserve -- */
+
+void* sr_slab_alloc(struct sr_slab* slab)
+{
+    void* obj;
+
+    if(!slab->free_list)
+    {
+        if(sr_slab_add_chunk(slab, slab->grow) != 0)
+        { return 0; }
+        slab->grows++;
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    if(++slab->in_use > slab->peak)
+    { slab->peak = slab->in_use; }
+
+    return obj;
+} /* -- sr_slab_alloc -- */
+
+void sr_slab_free(struct sr_slab* slab, void* obj)
+{
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+} /* -- sr_slab_free -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_slab_destroy
+ * Scope:  Global
+ *
+ * Release every chunk.  Objects still handed out become invalid.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_slab_destroy(struct sr_slab* slab)
+{
+    struct sr_slab_chunk* chunk = slab->chunks;
+
+    while(chunk)
+    {
+        struct sr_slab_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = 0;
+    slab->free_list = 0;
+    slab->in_use = 0;
+    slab->capacity = 0;
+} /* -- sr_slab_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_slab_print_stats
+ * Scope:  Global
+ *
+ * Print the occupancy counters of slab on one line, labelled name.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_slab_print_stats(const char* name, const struct sr_slab* slab)
+{
+    printf(" %-12s %8lu in use %8lu capacity %8lu peak %4lu grows\n",
+           name, slab->in_use, slab->capacity, slab->peak, slab->grows);
+} /* -- sr_slab_print_stats -- */
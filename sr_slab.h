@@ -0,0 +1,45 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.h
+ *
+ * Description:
+ *
+ * Fixed size object pools.  A slab hands out objects of one size from
+ * chunks it allocated up front, and takes them back on a free list, so
+ * records that are created and torn down per flow do not go through
+ * malloc/free.  If the reserve runs out the pool grows by another chunk
+ * rather than failing; grows counts how often that happened so the
+ * reserve can be sized up.
+ *
+ * Slabs do no locking of their own, the owner serializes access.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_SLAB_H
+#define sr_SLAB_H
+
+#include <stddef.h>
+
+struct sr_slab_chunk;
+
+struct sr_slab
+{
+    size_t size;            /* object size, rounded up for alignment */
+    unsigned long grow;     /* objects per chunk once the reserve is used */
+    void*  free_list;       /* free objects, linked through their first word */
+    struct sr_slab_chunk* chunks;
+
+    /* -- occupancy -- */
+    unsigned long in_use;
+    unsigned long capacity;
+    unsigned long peak;
+    unsigned long grows;    /* chunks added after the initial reserve */
+};
+
+void  sr_slab_init(struct sr_slab* slab, size_t size, unsigned long grow);
+int   sr_slab_reserve(struct sr_slab* slab, unsigned long n);
+void* sr_slab_alloc(struct sr_slab* slab);
+void  sr_slab_free(struct sr_slab* slab, void* obj);
+void  sr_slab_destroy(struct sr_slab* slab);
+void  sr_slab_print_stats(const char* name, const struct sr_slab* slab);
+
+#endif  /* --  sr_SLAB_H -- */
@@ -19,6 +19,52 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* Incremental checksum update after one 16 bit field of the covered data
+   changed from old to new (RFC 1624, eqn. 3). sum, old and new are taken
+   as they sit in the packet; the ones complement sum does not care about
+   byte order as long as all three agree. */
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s;
+
+  s = (uint16_t)~sum + (uint16_t)~old + new;
+  while (s > 0xffff)
+    s = (s >> 16) + (s & 0xffff);
+  return ~s;
+}
+
+/* Same for a 32 bit field, e.g. an address in the IPv4 pseudo header. */
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_adjust16(sum, old >> 16, new >> 16);
+  return cksum_adjust16(sum, old & 0xffff, new & 0xffff);
+}
+
+
+/* Hash of the 5-tuple of an IP packet (addresses, protocol and, for TCP
+   and UDP, the ports), used to keep a flow on one multipath next hop.
+   len is the number of bytes available from the start of the IP header. */
+uint32_t flow_hash(const uint8_t *buf, unsigned int len) {
+  const sr_ip_hdr_t *iphdr = (const sr_ip_hdr_t *)buf;
+  unsigned int hlen = iphdr->ip_hl * 4;
+  uint32_t h;
+
+  h = ntohl(iphdr->ip_src) * 2654435761U;
+  h ^= ntohl(iphdr->ip_dst) + 0x9e3779b9U + (h << 6) + (h >> 2);
+  h ^= iphdr->ip_p;
+  if ((iphdr->ip_p == 6 || iphdr->ip_p == 17) && len >= hlen + 4) {
+    uint32_t ports;
+    memcpy(&ports, buf + hlen, sizeof(ports));
+    h ^= ntohl(ports) + 0x9e3779b9U + (h << 6) + (h >> 2);
+  }
+
+  /* final avalanche so the low bits used for member selection mix well */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -39,6 +39,8 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_protocol.h"
 
 #include "sha1.h"
@@ -474,6 +476,10 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 fprintf(stderr,"Routing table not consistent with hardware\n");
                 return -1;
             }
+            sr_fib_bind_interfaces(sr->fib, sr->if_list);
+            sr_arpcache_bind_fib(&(sr->cache), sr->fib);
+            if(sr->nat_on && sr_nat_start(sr) != 0)
+            { return -1; }
             printf(" <-- Ready to process packets --> \n");
             break;
 
@@ -660,7 +666,7 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
 
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
+            !sr_arp_target_is_mine(sr, a_hdr->ar_tip, interface) )
     { return 1; }
 
     return 0;